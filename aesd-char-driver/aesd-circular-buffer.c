@@ -9,9 +9,17 @@
  */
 
 #ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/slab.h>
 #include <linux/string.h>
+#define slots_zalloc(size) kvzalloc(size, GFP_KERNEL)
+#define slots_free(ptr) kvfree(ptr)
 #else
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#define slots_zalloc(size) calloc(1, size)
+#define slots_free(ptr) free(ptr)
 #endif
 
 #include "aesd-circular-buffer.h"
@@ -29,63 +37,181 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    size_t total_size_seen = 0;
-    size_t offset = 0;
-    bool wrap_around = false;
-    uint8_t i;
-    for (i = buffer->out_offs; i <= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
+    struct aesd_buffer_slots *slots = buffer->slots;
+    struct aesd_buffer_entry *entry;
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    uint32_t out = buffer->out_offs & slots->mask;
+    uint32_t lo = 0;
+    uint32_t hi;
+    uint32_t mid;
+    size_t start;
+
+    // a lockless reader may see the count of a resized buffer, it is
+    // retried but must not search past the slots it loaded meanwhile
+    if(count > slots->mask + 1){
+        count = slots->mask + 1;
+    }
+    // entry starts grow from the oldest entry on, binary search for the
+    // last one starting at or before char_offset
+    hi = count;
+    while (lo < hi)
     {
-        // wrap around if reached the end of the array
-        if (i == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-        {
-            i = 0;
-            wrap_around = true;
+        mid = lo + (hi - lo) / 2;
+        if(slots->start[(out + mid) & slots->mask] - slots->start[out] <= char_offset){
+            lo = mid + 1;
         }
-        // whole array is searched if 'i' wraps around and hits out_offs again
-        if(wrap_around && i == buffer->out_offs){
-            break;
+        else{
+            hi = mid;
         }
+    }
+    if(lo == 0){
+        return NULL;
+    }
+    entry = &slots->entry[(out + lo - 1) & slots->mask];
+    start = slots->start[(out + lo - 1) & slots->mask] - slots->start[out];
+    if(char_offset - start >= entry->size){
+        return NULL;
+    }
+    *entry_offset_byte_rtn = char_offset - start;
+    return entry;
+}
 
-        total_size_seen += buffer->entry[i].size;
-        if(char_offset < total_size_seen){
-            *entry_offset_byte_rtn = char_offset-offset;
-            return &buffer->entry[i];
-        }
-        offset += buffer->entry[i].size;
+/**
+ * @param buffer the buffer @param entry belongs to.  Any necessary locking must be performed by caller.
+ * @return the entry written after @param entry, or NULL if @param entry is the most recent one.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_next_entry(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *entry)
+{
+    struct aesd_buffer_slots *slots = buffer->slots;
+    uint32_t i = (entry - slots->entry + 1) & slots->mask;
+
+    if(i == buffer->in_offs){
+        return NULL;
     }
-    return NULL;
+    return &slots->entry[i];
 }
 
 /**
 * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
-* If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
+* If the buffer was already full, drops the oldest entry and advances buffer->out_offs to the
 * new start location.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* @return the buffptr of the entry dropped to make room, for the caller to free, or NULL if none was.
 */
-void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *add_entry)
 {
+    struct aesd_buffer_slots *slots = buffer->slots;
+    struct aesd_buffer_entry *oldest = &slots->entry[buffer->out_offs];
+    const char *evicted = NULL;
+
     if(buffer->full){
-        // buffer is full, advance out_offs
-        buffer->out_offs++;
-        if(buffer->out_offs == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED){
-            buffer->out_offs = 0;
-        }
+        // buffer is full, advance out_offs past the oldest entry
+        evicted = oldest->buffptr;
+        buffer->total_size -= oldest->size;
+        oldest->buffptr = NULL;
+        oldest->size = 0;
+        buffer->out_offs = (buffer->out_offs + 1) & slots->mask;
     }
-    buffer->entry[buffer->in_offs] = *add_entry;
-    buffer->in_offs++;
+    // starts continue from the end of the newest entry, or over from 0
+    slots->start[buffer->in_offs] = buffer->in_offs == buffer->out_offs && !buffer->full ? 0 :
+            slots->start[buffer->out_offs] + buffer->total_size;
+    slots->entry[buffer->in_offs] = *add_entry;
+    buffer->in_offs = (buffer->in_offs + 1) & slots->mask;
     buffer->total_size += add_entry->size;
-    // pointer is at the end of allowed buffer space
-    if(buffer->in_offs == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED){
-        buffer->in_offs = buffer->out_offs;
-        buffer->full = true;
+    // a depth of as many entries as slots wraps to 0, in_offs caught up
+    // with out_offs then
+    buffer->full = ((buffer->in_offs - buffer->out_offs) & slots->mask) == (buffer->depth & slots->mask);
+    return evicted;
+}
+
+/**
+ * @return zeroed slots for a buffer of @param depth entries, rounded up to a power of two,
+ * or NULL if they couldn't be allocated.
+ */
+struct aesd_buffer_slots *aesd_circular_buffer_alloc_slots(uint32_t depth)
+{
+    struct aesd_buffer_slots *slots;
+    uint32_t n = 1;
+
+    while (n < depth){
+        n <<= 1;
+    }
+    slots = slots_zalloc(sizeof(*slots) + n * (sizeof(slots->entry[0]) + sizeof(slots->start[0])));
+    if(slots != NULL){
+        slots->mask = n - 1;
+        slots->start = (size_t *)&slots->entry[n];
+    }
+    return slots;
+}
+
+void aesd_circular_buffer_free_slots(struct aesd_buffer_slots *slots)
+{
+    slots_free(slots);
+}
+
+/**
+ * Sets up @param resized as a buffer of @param depth entries stored in @param slots, allocated by
+ * aesd_circular_buffer_alloc_slots for that depth, holding the most recent entries of @param buffer
+ * that fit.  @param buffer is left untouched, the caller frees the memory of the entries which didn't
+ * fit, the oldest ones, and the slots of @param buffer once it switched to @param resized.
+ * Any necessary locking must be handled by the caller
+ */
+void aesd_circular_buffer_resize(const struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_slots *slots, uint32_t depth, struct aesd_circular_buffer *resized)
+{
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    uint32_t keep = count < depth ? count : depth;
+    uint32_t first = buffer->out_offs + (count - keep);
+    uint32_t i;
+
+    memset(resized,0,sizeof(struct aesd_circular_buffer));
+    resized->slots = slots;
+    resized->depth = depth;
+    for (i = 0; i < keep; i++){
+        slots->entry[i] = buffer->slots->entry[(first + i) & buffer->slots->mask];
+        slots->start[i] = buffer->slots->start[(first + i) & buffer->slots->mask];
+        resized->total_size += slots->entry[i].size;
     }
+    resized->in_offs = keep & slots->mask;
+    resized->full = keep == depth;
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Initializes the circular buffer described by @param buffer to an empty struct keeping the
+* @param depth most recent entries.
+* @return 0, -EINVAL if @param depth is 0 or above AESDCHAR_MAX_DEPTH, or -ENOMEM.
 */
-void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
+int aesd_circular_buffer_init_depth(struct aesd_circular_buffer *buffer, uint32_t depth)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    if(depth == 0 || depth > AESDCHAR_MAX_DEPTH){
+        return -EINVAL;
+    }
+    buffer->slots = aesd_circular_buffer_alloc_slots(depth);
+    if(buffer->slots == NULL){
+        return -ENOMEM;
+    }
+    buffer->depth = depth;
+    return 0;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct keeping the
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED most recent entries.
+*/
+int aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
+{
+    return aesd_circular_buffer_init_depth(buffer, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+}
+
+/**
+* Frees the slots of @param buffer, the memory of its entries is up to the caller.
+*/
+void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer)
+{
+    aesd_circular_buffer_free_slots(buffer->slots);
+    buffer->slots = NULL;
 }
@@ -16,7 +16,10 @@
 #include <stdbool.h>
 #endif
 
+// depth of a buffer initialized with aesd_circular_buffer_init
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+// deepest buffer aesd_circular_buffer_init_depth sets up
+#define AESDCHAR_MAX_DEPTH (1U << 20)
 
 struct aesd_buffer_entry
 {
@@ -30,46 +33,95 @@ struct aesd_buffer_entry
     size_t size;
 };
 
+/*
+ * Storage for the entries of a circular buffer, a power of two of them so
+ * that offsets wrap with a mask.  The mask is stored with the entries so a
+ * lockless reader always indexes within the array it loaded, even if the
+ * buffer was resized meanwhile.
+ */
+struct aesd_buffer_slots
+{
+    /**
+     * Number of entries minus one
+     */
+    uint32_t mask;
+    /**
+     * Offset of each entry in the bytes added to the buffer, following the
+     * entries.  Only differences between entries held are meaningful, the
+     * offset of an entry relative to the oldest one is where it starts
+     */
+    size_t *start;
+    struct aesd_buffer_entry entry[];
+};
+
 struct aesd_circular_buffer
 {
     /**
      * An array of pointers to memory allocated for the most recent write operations
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_slots *slots;
+    /**
+     * Number of most recent write operations kept, at most the number of slots
+     */
+    uint32_t depth;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
-     * set to true when the buffer entry structure is full
+     * set to true when the buffer holds depth entries
      */
     bool full;
     /*
         Total size of all entries in the buffer
     */
-    uint8_t total_size;
+    size_t total_size;
 };
 
+/**
+ * @return the number of entries held by @param buffer
+ */
+static inline uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->full ? buffer->depth : (buffer->in_offs - buffer->out_offs) & buffer->slots->mask;
+}
+
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
-extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+extern struct aesd_buffer_entry *aesd_circular_buffer_next_entry(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *entry);
+
+extern const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *add_entry);
+
+extern struct aesd_buffer_slots *aesd_circular_buffer_alloc_slots(uint32_t depth);
+
+extern void aesd_circular_buffer_free_slots(struct aesd_buffer_slots *slots);
+
+extern void aesd_circular_buffer_resize(const struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_slots *slots, uint32_t depth, struct aesd_circular_buffer *resized);
+
+extern int aesd_circular_buffer_init_depth(struct aesd_circular_buffer *buffer, uint32_t depth);
+
+extern int aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
-extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
+extern void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer);
 
 /**
  * Create a for loop to iterate over each member of the circular buffer.
- * Useful when you've allocated memory for circular buffer entries and need to free it
+ * Useful when you've allocated memory for circular buffer entries and need to free it,
+ * slots not holding an entry have a NULL buffptr
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -77,9 +129,9 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  * }
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
-    for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
-            index++, entryptr=&((buffer)->entry[index]))
+    for(index=0, entryptr=&((buffer)->slots->entry[index]); \
+            index<=(buffer)->slots->mask; \
+            index++, entryptr=&((buffer)->slots->entry[index]))
 
 
 
@@ -38,9 +38,13 @@ struct aesd_seekto {
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Set the number of most recent writes the device keeps, from 1 to AESDCHAR_MAX_DEPTH
+#define AESDCHAR_IOCSETDEPTH _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+// Get the number of most recent writes the device keeps
+#define AESDCHAR_IOCGETDEPTH _IOR(AESD_IOC_MAGIC, 3, uint32_t)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 3
 
 #endif /* AESD_IOCTL_H */
@@ -25,6 +25,33 @@
 
 #include "aesd-circular-buffer.h"
 
+/*
+ * A page sized piece of the command being written, staged until its
+ * newline arrives
+ */
+struct aesd_chunk
+{
+    struct list_head list;
+    size_t used;
+    char data[];
+};
+
+#define AESD_CHUNK_DATA_SIZE (PAGE_SIZE - sizeof(struct aesd_chunk))
+
+// entries aesd_read copies out of the circular buffer at a time
+#define AESD_READ_BATCH 16
+
+/*
+ * A command added to the circular buffer, whose entry points at data.
+ * Freed after an SRCU grace period once evicted, readers may still be
+ * copying from it
+ */
+struct aesd_cmd
+{
+    struct rcu_head rcu;
+    char data[];
+};
+
 struct aesd_dev
 {
     /**
@@ -35,8 +62,20 @@ struct aesd_dev
 //     data until a \n character comes in
 //     add locking primitive
     struct aesd_circular_buffer buffer;
-    struct aesd_buffer_entry entry;
+    // chunks of the command written so far (for writes before \n), where
+    // it starts in the first one and its size, the last chunk is kept
+    // around for the next command
+    struct list_head pending;
+    size_t pending_off;
+    size_t pending_size;
+    // serializes writers, readers don't take it
     struct mutex lock;
+    // bumped around every change to the circular buffer, readers retry
+    // what they read from it meanwhile
+    seqcount_mutex_t seq;
+    // readers hold it while copying from commands, evicted commands are
+    // only freed once they all dropped it
+    struct srcu_struct srcu;
     struct cdev cdev;     /* Char device structure      */
 };
 
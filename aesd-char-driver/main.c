@@ -17,7 +17,10 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/list.h>
+#include <linux/seqlock.h>
 #include <linux/slab.h> // kmalloc
+#include <linux/srcu.h>
 #include <linux/uaccess.h> // copy_to_user
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
@@ -27,8 +30,27 @@ int aesd_minor =   0;
 MODULE_AUTHOR("Renat Khalikov");
 MODULE_LICENSE("Dual BSD/GPL");
 
+// most recent writes kept until changed with AESDCHAR_IOCSETDEPTH
+static unsigned int buffer_depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(buffer_depth, uint, 0444);
+MODULE_PARM_DESC(buffer_depth, "Number of most recent writes kept, 1 to 1048576");
+
 struct aesd_dev aesd_device;
 
+/*
+ * @return the command holding @param buffptr, the data of a circular buffer
+ * entry
+ */
+static struct aesd_cmd *aesd_cmd_of(const char *buffptr)
+{
+    return (struct aesd_cmd *)(buffptr - offsetof(struct aesd_cmd, data));
+}
+
+static void aesd_cmd_free_rcu(struct rcu_head *head)
+{
+    kfree(container_of(head, struct aesd_cmd, rcu));
+}
+
 int aesd_open(struct inode *inode, struct file *filp)
 {
     struct aesd_dev *dev;
@@ -115,16 +137,17 @@ loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
 {
     struct aesd_dev *dev = filp->private_data;
     loff_t file_pos;
+    size_t total_size;
+    unsigned int seq;
 
-    if (mutex_lock_interruptible(&dev->lock)){
-        return -ERESTARTSYS;
-    }
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        total_size = dev->buffer.total_size;
+    } while (read_seqcount_retry(&dev->seq, seq));
 
-    file_pos = fixed_size_llseek(filp, offset, whence, dev->buffer.total_size);
+    file_pos = fixed_size_llseek(filp, offset, whence, total_size);
     filp->f_pos = file_pos;
 
-    mutex_unlock(&dev->lock);
-
     return file_pos;
 }
 
@@ -153,40 +176,31 @@ static long aesd_adjust_file_offset(
 {
     long retval = 0;
     struct aesd_dev *dev = filp->private_data;
-    long total_len = 0;
-    int i;
+    struct aesd_circular_buffer *buffer = &dev->buffer;
+    struct aesd_buffer_slots *slots = buffer->slots;
+    struct aesd_buffer_entry *entry;
+    long total_len;
 
-    if(write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED || write_cmd < 0){
-        PDEBUG("write_cmd: %d is out of bounds!", write_cmd);
-        retval = -EINVAL;
-        goto out;
-    }
-    if(dev->buffer.entry[write_cmd].buffptr == NULL){
-        PDEBUG("buffer.entry command hasn't been written yet!");
+    // write_cmd counts from the oldest command kept, wherever its slot is
+    if(write_cmd >= aesd_circular_buffer_count(buffer)){
+        PDEBUG("write_cmd: %u hasn't been written yet!", write_cmd);
         retval = -EINVAL;
         goto out;
     }
-    if(dev->buffer.entry[write_cmd].size <= write_cmd_offset){
+    entry = &slots->entry[(buffer->out_offs + write_cmd) & slots->mask];
+    if(entry->size <= write_cmd_offset){
         PDEBUG(
             "buffer.entry command size: %ld <= write_cmd_offset: %d",
-            dev->buffer.entry[write_cmd].size,
+            entry->size,
             write_cmd_offset
         );
         retval = -EINVAL;
         goto out;
     }
 
-    for(i = 0; i<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++){
-        PDEBUG("total_len: %ld at i: %d", total_len, i);
-        if (i == write_cmd)
-        {
-            PDEBUG("Found the write command at i: %d", i);
-            total_len += write_cmd_offset;
-            break;
-        }
-        total_len += dev->buffer.entry[i].size;
-
-    }
+    // the offset of the command is its start relative to the oldest one
+    total_len = slots->start[(buffer->out_offs + write_cmd) & slots->mask] -
+            slots->start[buffer->out_offs & slots->mask] + write_cmd_offset;
     filp->f_pos = total_len;
     PDEBUG("filp->f_pos adjusted to %ld", total_len);
 
@@ -194,6 +208,51 @@ static long aesd_adjust_file_offset(
         return retval;
 }
 
+/*
+ * Switches the circular buffer of @param dev to keeping the @param depth
+ * most recent commands, freeing the older ones which no longer fit.
+ * @return 0, -EINVAL for a depth of 0 or above AESDCHAR_MAX_DEPTH, or
+ * -ENOMEM leaving the buffer as it was.
+ */
+static long aesd_resize(struct aesd_dev *dev, uint32_t depth)
+{
+    struct aesd_circular_buffer old, resized;
+    struct aesd_buffer_slots *slots;
+    uint32_t count, i;
+
+    if(depth == 0 || depth > AESDCHAR_MAX_DEPTH){
+        return -EINVAL;
+    }
+    if (mutex_lock_interruptible(&dev->lock)){
+        return -ERESTARTSYS;
+    }
+    slots = aesd_circular_buffer_alloc_slots(depth);
+    if(slots == NULL){
+        mutex_unlock(&dev->lock);
+        return -ENOMEM;
+    }
+    // the entries are copied with only writers held off, readers see the
+    // switch to the new slots as a single write
+    old = dev->buffer;
+    aesd_circular_buffer_resize(&old, slots, depth, &resized);
+    write_seqcount_begin(&dev->seq);
+    dev->buffer = resized;
+    write_seqcount_end(&dev->seq);
+    count = aesd_circular_buffer_count(&old);
+    for(i = 0; i + depth < count; i++){
+        call_srcu(&dev->srcu,
+                  &aesd_cmd_of(old.slots->entry[(old.out_offs + i) & old.slots->mask].buffptr)->rcu,
+                  aesd_cmd_free_rcu);
+    }
+    mutex_unlock(&dev->lock);
+
+    // no reader indexes the old slots once those which loaded them are done
+    synchronize_srcu(&dev->srcu);
+    aesd_circular_buffer_free_slots(old.slots);
+    PDEBUG("buffer depth set to %u", depth);
+    return 0;
+}
+
 /*
 read/write method and f_pos
     for the lseek system call to work correctly the read and write methods must
@@ -258,10 +317,9 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     struct aesd_seekto seekto;
     struct aesd_dev *dev = filp->private_data;
     long retval;
-
-    if (mutex_lock_interruptible(&dev->lock)){
-        return -ERESTARTSYS;
-    }
+    unsigned int seq;
+    uint32_t depth;
+    int idx;
 
     switch(cmd) {
         case AESDCHAR_IOCSEEKTO:
@@ -275,12 +333,30 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
                     seekto.write_cmd,
                     seekto.write_cmd_offset
                 );
-                retval = aesd_adjust_file_offset(
-                    filp,
-                    seekto.write_cmd,
-                    seekto.write_cmd_offset
-                );
+                // redone if a write changed the buffer meanwhile, the
+                // slots walked stay allocated until srcu_read_unlock
+                idx = srcu_read_lock(&dev->srcu);
+                do {
+                    seq = read_seqcount_begin(&dev->seq);
+                    retval = aesd_adjust_file_offset(
+                        filp,
+                        seekto.write_cmd,
+                        seekto.write_cmd_offset
+                    );
+                } while (read_seqcount_retry(&dev->seq, seq));
+                srcu_read_unlock(&dev->srcu, idx);
+            }
+            break;
+        case AESDCHAR_IOCSETDEPTH:
+            if(get_user(depth, (uint32_t __user *)arg) != 0){
+                retval = -EFAULT;
+                goto out;
             }
+            PDEBUG("AESDCHAR_IOCSETDEPTH: depth %u", depth);
+            retval = aesd_resize(dev, depth);
+            break;
+        case AESDCHAR_IOCGETDEPTH:
+            retval = put_user(READ_ONCE(dev->buffer.depth), (uint32_t __user *)arg);
             break;
         default:
             retval = -ENOTTY;
@@ -288,9 +364,7 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     }
 
     out:
-        mutex_unlock(&dev->lock);
-
-    return retval;
+        return retval;
 }
 
 /*
@@ -320,56 +394,234 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
     // the buf buffer will be used to fill read from userspace, can't access the
     // buffer directly, instead use copy_to_user to copy from kernel space to
     // user space
-    struct aesd_buffer_entry *buffer_entry;
-    size_t entry_offset_byte_rtn;
+    struct aesd_buffer_entry *buffer_entry = NULL;
+    struct aesd_buffer_entry batch[AESD_READ_BATCH];
+    size_t entry_offset_byte_rtn = 0;
+    size_t offset;
+    size_t wanted;
     size_t num_of_writes;
     int not_copied;
+    unsigned int seq;
+    unsigned int last_seq = 0;
+    bool resume = false;
+    int n;
+    int i;
+    int idx;
 
     PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
 
-    if (mutex_lock_interruptible(&dev->lock)){
-        return -ERESTARTSYS;
-    }
-
-    buffer_entry = aesd_circular_buffer_find_entry_offset_for_fpos(
-        &dev->buffer,
-        *f_pos,
-        &entry_offset_byte_rtn
-    );
-    if (buffer_entry == NULL){
-        *f_pos = 0;
-        goto out;
-    }
+    // readers run alongside writers and each other, the commands copied
+    // from stay allocated until srcu_read_unlock even if they are evicted
+    idx = srcu_read_lock(&dev->srcu);
+
+    // copies entries one after the other until count is satisfied, a batch
+    // at a time since copy_to_user may sleep
+    while (retval < count){
+        // the entries are copied out and the walk redone if a write changed
+        // the buffer meanwhile
+        do {
+            seq = read_seqcount_begin(&dev->seq);
+            // the start is only looked up once, later batches carry on from
+            // the entry after the last one copied unless a write moved it
+            if (!resume || seq != last_seq){
+                buffer_entry = aesd_circular_buffer_find_entry_offset_for_fpos(
+                    &dev->buffer,
+                    *f_pos,
+                    &entry_offset_byte_rtn
+                );
+            }
+            else{
+                entry_offset_byte_rtn = 0;
+            }
+            n = 0;
+            wanted = count - retval;
+            offset = entry_offset_byte_rtn;
+            while (buffer_entry != NULL && n < AESD_READ_BATCH && wanted > 0){
+                batch[n++] = *buffer_entry;
+                wanted -= min(wanted, buffer_entry->size - offset);
+                offset = 0;
+                buffer_entry = aesd_circular_buffer_next_entry(&dev->buffer, buffer_entry);
+            }
+        } while (read_seqcount_retry(&dev->seq, seq));
+        last_seq = seq;
+        resume = true;
 
-    // count - max number of writes to the buffer, may want to write less for this
-    num_of_writes = buffer_entry->size - entry_offset_byte_rtn;
-    if(count < num_of_writes){
-        num_of_writes = count;
-    }
+        if (n == 0){
+            if (retval == 0){
+                *f_pos = 0;
+            }
+            goto out;
+        }
 
-    not_copied = copy_to_user(
-        buf,
-        &buffer_entry->buffptr[entry_offset_byte_rtn],
-        num_of_writes
-    );
+        for (i = 0; i < n && retval < count; i++){
+            offset = i == 0 ? entry_offset_byte_rtn : 0;
+            // count - max number of writes to the buffer, may want to write less for this
+            num_of_writes = batch[i].size - offset;
+            if(count - retval < num_of_writes){
+                num_of_writes = count - retval;
+            }
 
-    // partial read rule
-    retval = num_of_writes - not_copied;
-    *f_pos += retval;
+            not_copied = copy_to_user(
+                buf + retval,
+                &batch[i].buffptr[offset],
+                num_of_writes
+            );
+
+            // partial read rule
+            retval += num_of_writes - not_copied;
+            *f_pos += num_of_writes - not_copied;
+            if (not_copied){
+                if (retval == 0){
+                    retval = -EFAULT;
+                }
+                goto out;
+            }
+        }
+        if (buffer_entry == NULL){
+            break;
+        }
+    }
 
     out:
-        mutex_unlock(&dev->lock);
+        srcu_read_unlock(&dev->srcu, idx);
 
     return retval;
 }
 
+/*
+staging the command being written
+    a command can arrive in any number of writes before its newline, growing
+    one allocation per write with krealloc copies everything written so far
+    each time
+    instead the bytes go into a list of page sized chunks, which are never
+    moved, and are copied once into an allocation of the exact size when the
+    newline arrives
+    a single write may also hold any number of newlines, each one ends a
+    command, and whatever follows the last one starts the next command
+    only the bytes a write copies in are scanned for newlines, once
+    the pending command starts at pending_off in the first chunk, the bytes
+    before it belonged to commands already added
+    the last chunk stays on the list after a command is added so short
+    commands don't allocate a chunk each
+*/
+
+/*
+ * @return the chunk the next written bytes are copied to, the last one
+ * unless it is full, or NULL if a new one couldn't be allocated.
+ */
+static struct aesd_chunk *aesd_chunk_with_room(struct aesd_dev *dev)
+{
+    struct aesd_chunk *chunk = list_empty(&dev->pending) ? NULL :
+            list_last_entry(&dev->pending, struct aesd_chunk, list);
+
+    if(chunk == NULL || chunk->used == AESD_CHUNK_DATA_SIZE){
+        chunk = kmalloc(PAGE_SIZE, GFP_KERNEL);
+        if(chunk != NULL){
+            chunk->used = 0;
+            list_add_tail(&chunk->list, &dev->pending);
+        }
+    }
+    return chunk;
+}
+
+/*
+ * Drops staged bytes from the end until @param size are left, undoing a
+ * write which couldn't be completed.  Must be called with dev->lock held.
+ */
+static void aesd_unstage(struct aesd_dev *dev, size_t size)
+{
+    struct aesd_chunk *chunk, *first;
+    size_t start;
+    size_t len;
+
+    while (dev->pending_size > size){
+        first = list_first_entry(&dev->pending, struct aesd_chunk, list);
+        chunk = list_last_entry(&dev->pending, struct aesd_chunk, list);
+        start = chunk == first ? dev->pending_off : 0;
+        len = min(chunk->used - start, dev->pending_size - size);
+        chunk->used -= len;
+        dev->pending_size -= len;
+        if(chunk->used == start && chunk != first){
+            list_del(&chunk->list);
+            kfree(chunk);
+        }
+    }
+    if(dev->pending_size == 0 && !list_empty(&dev->pending)){
+        // nothing left staged, the next command starts the first chunk over
+        list_first_entry(&dev->pending, struct aesd_chunk, list)->used = 0;
+        dev->pending_off = 0;
+    }
+}
+
+/*
+ * Copies the first @param size staged bytes, a complete command, into a
+ * single allocation and adds it to the circular buffer, freeing the oldest
+ * command if it is overwritten.  Chunks the command used up are freed,
+ * except the last chunk.  Must be called with dev->lock held.
+ * @return 0, or -ENOMEM leaving the command staged.
+ */
+static int aesd_commit(struct aesd_dev *dev, size_t size)
+{
+    struct aesd_buffer_entry entry;
+    struct aesd_chunk *chunk = list_first_entry(&dev->pending, struct aesd_chunk, list);
+    struct aesd_chunk *next;
+    struct aesd_cmd *cmd = kmalloc(sizeof(*cmd) + size, GFP_KERNEL);
+    const char *evicted;
+    char *buffptr;
+    size_t off = dev->pending_off;
+    size_t len;
+
+    if(cmd == NULL){
+        return -ENOMEM;
+    }
+    buffptr = cmd->data;
+    entry.buffptr = buffptr;
+    entry.size = 0;
+    while (1){
+        len = min(chunk->used - off, size - entry.size);
+        memcpy(&buffptr[entry.size], &chunk->data[off], len);
+        entry.size += len;
+        off += len;
+        if(off < chunk->used || list_is_last(&chunk->list, &dev->pending)){
+            break;
+        }
+        next = list_next_entry(chunk, list);
+        list_del(&chunk->list);
+        kfree(chunk);
+        chunk = next;
+        off = 0;
+    }
+    dev->pending_size -= size;
+    dev->pending_off = off;
+    if(dev->pending_size == 0){
+        chunk->used = 0;
+        dev->pending_off = 0;
+    }
+
+    // the buffer doesn't own its entries, the one dropped to make room is
+    // freed here once no reader can still be copying from it
+    write_seqcount_begin(&dev->seq);
+    evicted = aesd_circular_buffer_add_entry(&dev->buffer, &entry);
+    write_seqcount_end(&dev->seq);
+    if(evicted != NULL){
+        call_srcu(&dev->srcu, &aesd_cmd_of(evicted)->rcu, aesd_cmd_free_rcu);
+    }
+    return 0;
+}
+
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
-    ssize_t retval = -ENOMEM;
+    ssize_t retval = 0;
     struct aesd_dev *dev = filp->private_data;
-    ssize_t num_not_copied;
-    ssize_t i;
+    struct aesd_chunk *chunk;
+    size_t pending_size;
+    // bytes of buf copied in, and those up to the last newline among them
+    size_t written = 0;
+    size_t stored = 0;
+    size_t len;
+    size_t copied;
+    char *start, *end, *scan, *newline;
 
     PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
 
@@ -377,32 +629,47 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
         return -ERESTARTSYS;
     }
 
-    dev->entry.buffptr = krealloc(
-        dev->entry.buffptr,
-        dev->entry.size + count,
-        GFP_KERNEL
-    );
-
     // append to the command being written when there's no newline received
-    num_not_copied = copy_from_user(
-        (void *)&dev->entry.buffptr[dev->entry.size],
-        buf,
-        count
-    );
-
-    retval = count - num_not_copied;
-    dev->entry.size += retval;
-
-    for (i = 0; i < dev->entry.size; i++){
-        if(dev->entry.buffptr[i] == '\n'){
-            // write to the command buffer when a newline is received
-            aesd_circular_buffer_add_entry(&dev->buffer, &dev->entry);
-            dev->entry.buffptr = NULL;
-            dev->entry.size = 0;
+    pending_size = dev->pending_size;
+    while (written < count){
+        chunk = aesd_chunk_with_room(dev);
+        if(chunk == NULL){
+            retval = -ENOMEM;
+            break;
+        }
+        len = min_t(size_t, count - written, AESD_CHUNK_DATA_SIZE - chunk->used);
+        start = &chunk->data[chunk->used];
+        copied = len - copy_from_user(start, buf + written, len);
+        chunk->used += copied;
+        dev->pending_size += copied;
+        end = start + copied;
+
+        // write to the command buffer when a newline is received, only the
+        // bytes just copied in can hold new ones
+        for (scan = start; (newline = memchr(scan, '\n', end - scan)) != NULL; scan = newline + 1){
+            if(aesd_commit(dev, dev->pending_size - (end - newline - 1)) != 0){
+                // the commands already added stay, the rest of the write is
+                // dropped and can be retried
+                aesd_unstage(dev, stored > 0 ? 0 : pending_size);
+                retval = stored > 0 ? stored : -ENOMEM;
+                goto out;
+            }
+            stored = written + (newline + 1 - start);
+        }
+
+        written += copied;
+        if(copied < len){
+            retval = -EFAULT;
+            break;
         }
     }
+    // a short write keeps the bytes staged so far
+    if(written > 0){
+        retval = written;
+    }
 
-    mutex_unlock(&dev->lock);
+    out:
+        mutex_unlock(&dev->lock);
     return retval;
 }
 struct file_operations aesd_fops = {
@@ -450,12 +717,27 @@ int aesd_init_module(void)
     // initalize all the things added to struct aesd_dev
     // the locking primative
     //
-    aesd_circular_buffer_init(&aesd_device.buffer);
+    result = aesd_circular_buffer_init_depth(&aesd_device.buffer, buffer_depth);
+    if( result ) {
+        printk(KERN_WARNING "Can't keep %u writes\n", buffer_depth);
+        unregister_chrdev_region(dev, 1);
+        return result;
+    }
+    INIT_LIST_HEAD(&aesd_device.pending);
     mutex_init(&aesd_device.lock);
+    seqcount_mutex_init(&aesd_device.seq, &aesd_device.lock);
+    result = init_srcu_struct(&aesd_device.srcu);
+    if( result ) {
+        aesd_circular_buffer_free(&aesd_device.buffer);
+        unregister_chrdev_region(dev, 1);
+        return result;
+    }
 
     result = aesd_setup_cdev(&aesd_device);
 
     if( result ) {
+        cleanup_srcu_struct(&aesd_device.srcu);
+        aesd_circular_buffer_free(&aesd_device.buffer);
         unregister_chrdev_region(dev, 1);
     }
     return result;
@@ -464,8 +746,9 @@ int aesd_init_module(void)
 
 void aesd_cleanup_module(void)
 {
-    uint8_t index;
+    uint32_t index;
     struct aesd_buffer_entry *entry;
+    struct aesd_chunk *chunk, *tmp;
     dev_t devno = MKDEV(aesd_major, aesd_minor);
 
     cdev_del(&aesd_device.cdev);
@@ -476,8 +759,18 @@ void aesd_cleanup_module(void)
     // balance whatever youre doing in the init_module with what youre doing in
     // here, aka allocate memory == free memory
     // initialize primitives == free locking primitives
+    // commands evicted earlier are freed by their SRCU callbacks
+    srcu_barrier(&aesd_device.srcu);
+    cleanup_srcu_struct(&aesd_device.srcu);
     AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buffer, index) {
-        kfree(entry->buffptr);
+        if(entry->buffptr != NULL){
+            kfree(aesd_cmd_of(entry->buffptr));
+        }
+    }
+    aesd_circular_buffer_free(&aesd_device.buffer);
+    list_for_each_entry_safe(chunk, tmp, &aesd_device.pending, list){
+        list_del(&chunk->list);
+        kfree(chunk);
     }
     mutex_destroy(&aesd_device.lock);
 
@@ -0,0 +1,612 @@
+/**
+ * @file aesdbench.c
+ * @brief Load generator and benchmark client for aesdsocket
+ *
+ * Worker threads each drive a share of the connections from an epoll loop.
+ * Every connection sends newline terminated packets of a fixed size,
+ * tagged with the connection and packet number, optionally paced at a
+ * fixed rate, and checks the echoed history for them:
+ *
+ * - Without -s every packet gets a connection of its own and the echo ends
+ *   when the server closes it, as aesdsocket does outside session mode.
+ * - With -s a connection sends all its packets, the next one as soon as
+ *   the echo of the previous one arrived.  Echoes aren't delimited, but
+ *   each one restarts the history from its first line, which marks where
+ *   the next echo begins.  This needs the file backend, whose history
+ *   never changes its start.
+ *
+ * With the file backend (-B file) every packet must appear in its echo
+ * past the previous packet of the same connection.  The aesdchar device
+ * (-B dev) and a data file with bounded retention (-B window) only keep
+ * the latest writes, so there a packet missing from its echo is counted
+ * as evicted instead of failing.
+ *
+ * With -C the connections are spread round robin over that many channels,
+ * the ports following the one given.
+ *
+ * Latency runs from when a packet was due to be sent until its echo
+ * arrived, so a server falling behind a paced load shows up in the
+ * latency rather than as a lower send rate.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define BENCH_MAX_EVENTS 64
+#define BENCH_RECV_SIZE 65536
+// a packet whose echo takes longer than this since it was sent times out
+#define BENCH_TIMEOUT_NS 10000000000ULL
+// room for the connection and packet number tag
+#define BENCH_MIN_PACKET 24
+
+struct bconn {
+    int fd;
+    int id;
+    // packets completed, the one in flight is numbered seq
+    unsigned seq;
+    bool busy;
+    bool failed;
+    // time the packet in flight was, or the next one is, due
+    uint64_t due;
+    // time the packet in flight was actually sent
+    uint64_t started;
+    char *out;
+    size_t out_sent;
+    // the echo so far without -s, the unparsed partial line with -s
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+    // where the previous packet was found in the history
+    size_t last_offset;
+    // with -s, the line starting every echo and the echoes started so far
+    char *first_line;
+    size_t first_len;
+    unsigned responses;
+};
+
+struct bthread {
+    pthread_t thread;
+    int epfd;
+    struct bconn *conns;
+    int nconns;
+    uint64_t *latencies;
+    size_t nlatencies;
+    size_t latencies_cap;
+    unsigned long ok;
+    unsigned long errors;
+    unsigned long evicted;
+    unsigned long timeouts;
+    unsigned long long bytes_in;
+};
+
+// the address of every channel
+static struct addrinfo **servers;
+static int nr_channels = 1;
+static int nr_conns = 16;
+static int nr_threads;
+static unsigned nr_packets = 100;
+static unsigned duration;
+static size_t packet_size = 64;
+static unsigned rate;
+static bool session_mode;
+// -B backend, and whether its history only keeps the latest writes
+static const char *backend = "file";
+static bool windowed;
+static uint64_t run_end;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void fill_packet(struct bconn *conn)
+{
+    int len = snprintf(conn->out, packet_size, "c%05d-%010u ", conn->id, conn->seq);
+    memset(conn->out + len, 'x', packet_size - len - 1);
+    conn->out[packet_size - 1] = '\n';
+    conn->out_sent = 0;
+}
+
+static bool in_reserve(struct bconn *conn, size_t len)
+{
+    if(conn->in_cap - conn->in_len >= len){
+        return true;
+    }
+    size_t cap = conn->in_cap ? conn->in_cap : BENCH_RECV_SIZE;
+    while (cap - conn->in_len < len){
+        cap *= 2;
+    }
+    char *in = realloc(conn->in, cap);
+    if(in == NULL){
+        return false;
+    }
+    conn->in = in;
+    conn->in_cap = cap;
+    return true;
+}
+
+static bool watch(struct bthread *self, struct bconn *conn, int op, uint32_t events)
+{
+    struct epoll_event ev = { .events = events, .data.ptr = conn };
+    return epoll_ctl(self->epfd, op, conn->fd, &ev) == 0;
+}
+
+static bool conn_connect(struct bthread *self, struct bconn *conn)
+{
+    const struct addrinfo *server = servers[conn->id % nr_channels];
+
+    conn->fd = socket(server->ai_family, server->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                      server->ai_protocol);
+    if(conn->fd < 0){
+        return false;
+    }
+    if(connect(conn->fd, server->ai_addr, server->ai_addrlen) < 0 && errno != EINPROGRESS){
+        close(conn->fd);
+        conn->fd = -1;
+        return false;
+    }
+    return watch(self, conn, EPOLL_CTL_ADD, EPOLLIN);
+}
+
+/*
+ * Gives up on @param conn, counting the packet in flight in @param counter.
+ */
+static void conn_abort(struct bconn *conn, unsigned long *counter, const char *why)
+{
+    fprintf(stderr, "connection %d packet %u: %s\n", conn->id, conn->seq, why);
+    (*counter)++;
+    conn->busy = false;
+    conn->failed = true;
+    if(conn->fd >= 0){
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+static void conn_fail(struct bthread *self, struct bconn *conn, const char *why)
+{
+    conn_abort(conn, &self->errors, why);
+}
+
+static void conn_complete(struct bthread *self, struct bconn *conn)
+{
+    uint64_t now = now_ns();
+
+    if(self->nlatencies == self->latencies_cap){
+        size_t cap = self->latencies_cap ? self->latencies_cap * 2 : 4096;
+        uint64_t *latencies = realloc(self->latencies, cap * sizeof(*latencies));
+        if(latencies != NULL){
+            self->latencies = latencies;
+            self->latencies_cap = cap;
+        }
+    }
+    if(self->nlatencies < self->latencies_cap){
+        self->latencies[self->nlatencies++] = now - conn->due;
+    }
+    self->ok++;
+    conn->seq++;
+    conn->busy = false;
+    // paced packets stay on their schedule even when the server lags
+    conn->due = rate ? conn->due + 1000000000ULL / rate : now;
+}
+
+static void start_packet(struct bthread *self, struct bconn *conn, uint64_t now)
+{
+    fill_packet(conn);
+    conn->busy = true;
+    conn->started = now;
+    if(!session_mode){
+        conn->in_len = 0;
+        if(!conn_connect(self, conn)){
+            conn_fail(self, conn, "connect failed");
+            return;
+        }
+    }
+    if(!watch(self, conn, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT)){
+        conn_fail(self, conn, "epoll_ctl failed");
+    }
+}
+
+/*
+ * Checks the whole echo of a connection of its own.
+ */
+static void check_echo(struct bthread *self, struct bconn *conn)
+{
+    char *found;
+
+    close(conn->fd);
+    conn->fd = -1;
+    if(conn->in_len == 0 || conn->in[conn->in_len - 1] != '\n'){
+        conn_fail(self, conn, "echo not newline terminated");
+        return;
+    }
+    found = memmem(conn->in + conn->last_offset,
+                   conn->last_offset < conn->in_len ? conn->in_len - conn->last_offset : 0,
+                   conn->out, packet_size);
+    if(found == NULL){
+        if(windowed){
+            // pushed out of the window by other writes
+            self->evicted++;
+            conn_complete(self, conn);
+            return;
+        }
+        conn_fail(self, conn, memmem(conn->in, conn->in_len, conn->out, packet_size) ?
+                              "packet echoed out of order" : "packet missing from echo");
+        return;
+    }
+    if(!windowed){
+        conn->last_offset = found - conn->in + packet_size;
+    }
+    conn_complete(self, conn);
+}
+
+/*
+ * Splits session echoes into lines, counting echoes by their first line and
+ * completing the packet in flight once its echo carries it.
+ */
+static void parse_session(struct bthread *self, struct bconn *conn)
+{
+    size_t start = 0;
+    char *nl;
+
+    while ((nl = memchr(conn->in + start, '\n', conn->in_len - start)) != NULL){
+        char *line = conn->in + start;
+        size_t len = nl - line + 1;
+        start += len;
+
+        if(conn->first_line == NULL){
+            conn->first_line = malloc(len);
+            if(conn->first_line == NULL){
+                conn_fail(self, conn, "out of memory");
+                return;
+            }
+            memcpy(conn->first_line, line, len);
+            conn->first_len = len;
+            conn->responses = 1;
+        }
+        else if(len == conn->first_len && memcmp(line, conn->first_line, len) == 0){
+            conn->responses++;
+        }
+
+        if(conn->responses > conn->seq + 1){
+            conn_fail(self, conn, "packet missing from echo");
+            return;
+        }
+        if(conn->busy && conn->responses == conn->seq + 1 && len == packet_size &&
+           memcmp(line, conn->out, len) == 0){
+            conn_complete(self, conn);
+        }
+    }
+    memmove(conn->in, conn->in + start, conn->in_len - start);
+    conn->in_len -= start;
+}
+
+static void conn_handle(struct bthread *self, struct bconn *conn, uint32_t events)
+{
+    if((events & EPOLLOUT) && conn->busy && conn->out_sent < packet_size){
+        ssize_t sent = send(conn->fd, conn->out + conn->out_sent, packet_size - conn->out_sent,
+                            MSG_NOSIGNAL);
+        if(sent < 0 && errno != EAGAIN && errno != EINTR){
+            conn_fail(self, conn, strerror(errno));
+            return;
+        }
+        if(sent > 0){
+            conn->out_sent += sent;
+        }
+        if(conn->out_sent == packet_size && !watch(self, conn, EPOLL_CTL_MOD, EPOLLIN)){
+            conn_fail(self, conn, "epoll_ctl failed");
+            return;
+        }
+    }
+    if(!(events & (EPOLLIN | EPOLLERR | EPOLLHUP))){
+        return;
+    }
+
+    while (1){
+        if(!in_reserve(conn, BENCH_RECV_SIZE)){
+            conn_fail(self, conn, "out of memory");
+            return;
+        }
+        ssize_t n = recv(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len, 0);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno == EAGAIN){
+                break;
+            }
+            conn_fail(self, conn, strerror(errno));
+            return;
+        }
+        if(n == 0){
+            if(session_mode || !conn->busy){
+                conn_fail(self, conn, "closed by the server");
+            }
+            else{
+                check_echo(self, conn);
+            }
+            return;
+        }
+        self->bytes_in += n;
+        conn->in_len += n;
+        if(session_mode){
+            parse_session(self, conn);
+            if(conn->failed){
+                return;
+            }
+        }
+    }
+}
+
+static bool conn_wants_packet(const struct bconn *conn)
+{
+    if(conn->busy || conn->failed){
+        return false;
+    }
+    return duration ? conn->due < run_end : conn->seq < nr_packets;
+}
+
+static void *bench_run(void *arg)
+{
+    struct bthread *self = arg;
+    struct epoll_event events[BENCH_MAX_EVENTS];
+
+    for (int i = 0; i < self->nconns; i++){
+        struct bconn *conn = &self->conns[i];
+        conn->due = now_ns();
+        if(session_mode && !conn_connect(self, conn)){
+            conn_fail(self, conn, "connect failed");
+        }
+    }
+
+    while (1){
+        uint64_t now = now_ns();
+        uint64_t next_due = UINT64_MAX;
+        bool active = false;
+
+        for (int i = 0; i < self->nconns; i++){
+            struct bconn *conn = &self->conns[i];
+            if(conn_wants_packet(conn) && conn->due <= now){
+                start_packet(self, conn, now);
+            }
+            if(conn->busy && now - conn->started > BENCH_TIMEOUT_NS){
+                conn_abort(conn, &self->timeouts, "timed out");
+            }
+            if(conn->busy){
+                active = true;
+            }
+            else if(conn_wants_packet(conn)){
+                active = true;
+                if(conn->due < next_due){
+                    next_due = conn->due;
+                }
+            }
+        }
+        if(!active){
+            break;
+        }
+
+        int timeout = 100;
+        if(next_due != UINT64_MAX){
+            uint64_t wait_ms = next_due > now ? (next_due - now + 999999) / 1000000 : 0;
+            timeout = wait_ms < (uint64_t) timeout ? (int) wait_ms : timeout;
+        }
+        int n = epoll_wait(self->epfd, events, BENCH_MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++){
+            conn_handle(self, events[i].data.ptr, events[i].events);
+        }
+    }
+
+    for (int i = 0; i < self->nconns; i++){
+        if(self->conns[i].fd >= 0){
+            close(self->conns[i].fd);
+        }
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, size_t n, double p)
+{
+    if(n == 0){
+        return 0;
+    }
+    size_t i = (size_t) (p * (n - 1) + 0.5);
+    return sorted[i] / 1e3;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-a address] [-p port] [-c connections] [-t threads] [-n packets | -d seconds] "
+            "[-l packet_size] [-r packets_per_second] [-s] [-B file|dev|window] [-C channels]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *addr = "localhost";
+    const char *port = "9000";
+    struct addrinfo hints;
+    struct bthread *threads;
+    int opt;
+    int status;
+
+    while ((opt = getopt(argc, argv, "a:p:c:t:n:d:l:r:sB:C:")) != -1){
+        switch (opt){
+            case 'a':
+                addr = optarg;
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            case 'c':
+                nr_conns = atoi(optarg);
+                break;
+            case 't':
+                nr_threads = atoi(optarg);
+                break;
+            case 'n':
+                // packets per connection
+                nr_packets = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                // run for this long instead of a number of packets
+                duration = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                packet_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                // packets per second and connection, 0 for as fast as echoed
+                rate = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                session_mode = true;
+                break;
+            case 'B':
+                if(strcmp(optarg, "dev") != 0 && strcmp(optarg, "window") != 0 &&
+                   strcmp(optarg, "file") != 0){
+                    usage(argv[0]);
+                    return -1;
+                }
+                backend = optarg;
+                windowed = strcmp(optarg, "file") != 0;
+                break;
+            case 'C':
+                nr_channels = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+    if(nr_conns <= 0 || nr_channels <= 0 || packet_size < BENCH_MIN_PACKET || (nr_packets == 0 && duration == 0)){
+        usage(argv[0]);
+        return -1;
+    }
+    if(session_mode && windowed){
+        fprintf(stderr, "Session echoes can only be told apart with the file backend\n");
+        return -1;
+    }
+    if(nr_threads <= 0){
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nr_threads = ncpu > 0 ? (int) ncpu : 1;
+    }
+    if(nr_threads > nr_conns){
+        nr_threads = nr_conns;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    servers = calloc(nr_channels, sizeof(*servers));
+    if(servers == NULL){
+        return -1;
+    }
+    for (int i = 0; i < nr_channels; i++){
+        char chan_port[8];
+        snprintf(chan_port, sizeof(chan_port), "%d", atoi(port) + i);
+        if((status = getaddrinfo(addr, nr_channels > 1 ? chan_port : port, &hints, &servers[i])) != 0){
+            fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(status));
+            return -1;
+        }
+    }
+
+    threads = calloc(nr_threads, sizeof(*threads));
+    if(threads == NULL){
+        return -1;
+    }
+    for (int i = 0, id = 0; i < nr_threads; i++){
+        struct bthread *t = &threads[i];
+        t->nconns = nr_conns / nr_threads + (i < nr_conns % nr_threads);
+        t->conns = calloc(t->nconns, sizeof(*t->conns));
+        t->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if(t->conns == NULL || t->epfd < 0){
+            perror("thread setup");
+            return -1;
+        }
+        for (int j = 0; j < t->nconns; j++){
+            t->conns[j].fd = -1;
+            t->conns[j].id = id++;
+            t->conns[j].out = malloc(packet_size);
+            if(t->conns[j].out == NULL){
+                return -1;
+            }
+        }
+    }
+
+    uint64_t start = now_ns();
+    run_end = start + duration * 1000000000ULL;
+    for (int i = 0; i < nr_threads; i++){
+        if(pthread_create(&threads[i].thread, NULL, bench_run, &threads[i]) != 0){
+            perror("pthread_create");
+            return -1;
+        }
+    }
+
+    unsigned long ok = 0, errors = 0, evicted = 0, timeouts = 0;
+    unsigned long long bytes_in = 0;
+    size_t nlatencies = 0;
+    for (int i = 0; i < nr_threads; i++){
+        pthread_join(threads[i].thread, NULL);
+        ok += threads[i].ok;
+        errors += threads[i].errors;
+        evicted += threads[i].evicted;
+        timeouts += threads[i].timeouts;
+        bytes_in += threads[i].bytes_in;
+        nlatencies += threads[i].nlatencies;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    uint64_t *latencies = malloc((nlatencies ? nlatencies : 1) * sizeof(*latencies));
+    if(latencies == NULL){
+        return -1;
+    }
+    for (int i = 0, n = 0; i < nr_threads; i++){
+        memcpy(latencies + n, threads[i].latencies, threads[i].nlatencies * sizeof(*latencies));
+        n += threads[i].nlatencies;
+    }
+    qsort(latencies, nlatencies, sizeof(*latencies), compare_u64);
+
+    printf("%d connections, %d threads, %zu byte packets%s, %s backend", nr_conns, nr_threads,
+           packet_size, session_mode ? " over sessions" : "", backend);
+    if(nr_channels > 1){
+        printf(", %d channels", nr_channels);
+    }
+    printf("\n");
+    printf("elapsed      %.3f s\n", elapsed);
+    printf("packets      %lu ok, %lu errors, %lu timed out", ok, errors, timeouts);
+    if(windowed){
+        printf(", %lu evicted", evicted);
+    }
+    printf("\nthroughput   %.1f packets/s, %.2f MB/s sent, %.2f MB/s echoed\n", ok / elapsed,
+           ok * packet_size / elapsed / 1e6, bytes_in / elapsed / 1e6);
+    printf("latency us   p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+           percentile_us(latencies, nlatencies, 0.5), percentile_us(latencies, nlatencies, 0.99),
+           percentile_us(latencies, nlatencies, 0.999),
+           nlatencies ? latencies[nlatencies - 1] / 1e3 : 0);
+
+    for (int i = 0; i < nr_channels; i++){
+        freeaddrinfo(servers[i]);
+    }
+    free(servers);
+    return errors || timeouts ? 1 : 0;
+}
@@ -1,385 +1,1278 @@
+#define _GNU_SOURCE
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <syslog.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <pthread.h>
+#include <poll.h>
 #include "queue.h"
 #include <time.h>
-#include "../aesd-char-driver/aesd_ioctl.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include "aesdsocket.h"
+#include "channel.h"
+#include "command.h"
+#include "datalog.h"
+#include "framebuf.h"
+#include "logger.h"
+#include "metrics.h"
+#include "pool.h"
+#include "ratelimit.h"
+#include "reactor.h"
+#include "response.h"
+#include "uring.h"
+#include "workers.h"
 
+#ifndef USE_AESD_CHAR_DEVICE
 #define USE_AESD_CHAR_DEVICE 1
+#endif
 
 char *AESD_CHAR_DEVICE = "/dev/aesdchar";
 
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 char *AESD_SOCKET_DATA = "/var/tmp/aesdsocketdata";
+// lines and bytes of history kept and echoed, 0 for all of it
+long RETAIN_LINES = 0;
+long RETAIN_BYTES = 0;
 
+bool SESSION_MODE = false;
+int SESSION_IDLE_TIMEOUT = 30;
 
-void appendToFile(FILE ** fp, char *writestr){
-    // syslog(LOG_DEBUG, "Writing %s to %s", writestr, basename(writefile));
+int MAX_CONNECTIONS = 0;
+bool SHED_LOAD = false;
+size_t MAX_PACKET_SIZE = 0;
+unsigned RATE_LIMIT = 0;
+int SEND_TIMEOUT = 30;
+// counted even without a limit, shutdown waits for it to drop to zero
+int active_conns = 0;
+pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t admission_cond = PTHREAD_COND_INITIALIZER;
 
-    // FILE *fp = fopen(writefile, "a");
-    if (*fp == NULL) {
-        syslog(LOG_ERR, "Error opening file");
-        exit(1);
-    }
-    if(strstr(writestr, "AESDCHAR_IOCSEEKTO") != NULL){
-        struct aesd_seekto seekto;
-
-        char *iocseekto = strtok(writestr, ":"); // first token
-        seekto.write_cmd = atoi(strtok(NULL, ",")); // second token
-        seekto.write_cmd_offset = atoi(strtok(NULL, ",")); // third token
+/*
+ * Takes a connection slot, waiting for one to free up when @param wait is
+ * set.
+ */
+bool admit(bool wait){
+    bool admitted;
 
-        int ioctl_fd = fileno(*fp);
-        int result_ret = ioctl(ioctl_fd, AESDCHAR_IOCSEEKTO, &seekto);
-        printf(
-            "Send %s with cmd: %d offset: %d, result: %d\n",
-            iocseekto,
-            seekto.write_cmd,
-            seekto.write_cmd_offset,
-            result_ret
-        );
+    if(MAX_CONNECTIONS == 0){
+        __atomic_add_fetch(&active_conns, 1, __ATOMIC_RELAXED);
+        return true;
     }
-    else{
-        fputs(writestr, *fp);
-        fseek(*fp, 0, SEEK_SET);
+    pthread_mutex_lock(&admission_lock);
+    if(wait && active_conns >= MAX_CONNECTIONS){
+        uint64_t start = metrics_now();
+        while (active_conns >= MAX_CONNECTIONS){
+            pthread_cond_wait(&admission_cond, &admission_lock);
+        }
+        metrics_record_since(METRICS_ADMISSION_WAIT, start);
     }
-
-    if (ferror(*fp)) {
-        syslog(LOG_ERR, "Error writing file: %s", writestr);
-        exit(1);
+    admitted = active_conns < MAX_CONNECTIONS;
+    if(admitted){
+        __atomic_add_fetch(&active_conns, 1, __ATOMIC_RELAXED);
     }
+    pthread_mutex_unlock(&admission_lock);
+    return admitted;
 }
 
+bool conn_admit(void){
+    return admit(!SHED_LOAD);
+}
 
-bool send_all(int socket, void *buffer, ssize_t length)
-{
-    char *ptr = (char*) buffer;
-    while (length > 0)
-    {
-        ssize_t bytes_to_send = 1024;
-        if(length < 1024){
-            bytes_to_send = length;
-        }
-        ssize_t i = send(socket, ptr, bytes_to_send, 0);
-        if (i < 1){
-            printf("Fail send %s\n", strerror(errno));
-            return false;
-        }
-        ptr += i;
-        length -= i;
+bool conn_try_admit(void){
+    return admit(false);
+}
+
+void conn_release(void){
+    if(MAX_CONNECTIONS == 0){
+        __atomic_sub_fetch(&active_conns, 1, __ATOMIC_RELEASE);
+        return;
     }
-    return true;
+    pthread_mutex_lock(&admission_lock);
+    __atomic_sub_fetch(&active_conns, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&admission_cond);
+    pthread_mutex_unlock(&admission_lock);
 }
 
-void openFile(char *filename, int acceptedfd){
-    FILE * fp;
-    char * line = (char*) malloc(20000);
-    size_t len = 1024;
-    ssize_t read;
-
-    fp = fopen(filename, "r");
-    if (fp == NULL)
-        exit(EXIT_FAILURE);
-
-    while ((read = getline(&line, &len, fp)) != -1) {
-        // printf("Retrieved line of length %zu\n", read);
-        char *ptr = (char*) line;
-        while (len > 0)
-        {
-            ssize_t bytes_to_send = 1024;
-            if(read < 1024){
-                bytes_to_send = read;
+
+/*
+ * Writes all of @param packet to the device @param fd, in a single write
+ * unless the driver takes less.
+ * @return 0 on success, -1 on error.
+ */
+static int write_packet(int fd, const char *packet, size_t len){
+    while (len > 0){
+        ssize_t written = write(fd, packet, len);
+        if(written < 0){
+            if(errno == EINTR){
+                continue;
             }
-            ssize_t i = send(acceptedfd, ptr, bytes_to_send, 0);
-            // if (i < 1){
-            //     printf("Fail send %s\n", strerror(errno));
-            // }
-            ptr += i;
-            read -= i;
+            logger_log(LOG_ERR, "Fail write %s", strerror(errno));
+            return -1;
         }
+        packet += written;
+        len -= written;
+    }
+    return 0;
+}
+
 
+int TIMESTAMP_PERIOD = 10;
+
+/*
+ * Opens a timer firing every TIMESTAMP_PERIOD seconds.  The deadlines are
+ * absolute on CLOCK_MONOTONIC so the period doesn't drift with the time
+ * spent appending.
+ */
+int open_timestamp_timer(bool nonblock){
+    struct itimerspec its;
+    int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | (nonblock ? TFD_NONBLOCK : 0));
+    if(timerfd < 0){
+        perror("timerfd_create");
+        return -1;
     }
 
-    fclose(fp);
-    free(line);
+    memset(&its, 0, sizeof(its));
+    clock_gettime(CLOCK_MONOTONIC, &its.it_value);
+    its.it_value.tv_sec += TIMESTAMP_PERIOD;
+    its.it_interval.tv_sec = TIMESTAMP_PERIOD;
+    if(timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0){
+        perror("timerfd_settime");
+        close(timerfd);
+        return -1;
+    }
+    return timerfd;
 }
 
-void append_timestamp(){
+/*
+ * Appends a timestamp to every channel once @param timerfd expired.  Only
+ * ever called from one thread at a time.
+ */
+void append_timestamp(int timerfd){
+    uint64_t expirations;
     time_t rawtime;
-    struct tm *info;
-    char buffer[80];
+    struct tm info;
+    // the last record doubles as the formatting cache, and as the append
+    // buffer it must stay untouched until every writer published it
+    static char buffer[80];
+    static size_t len;
+    static time_t formatted = -1;
+
+    if(read(timerfd, &expirations, sizeof(expirations)) != sizeof(expirations)){
+        return;
+    }
+
+    for (int i = 0; i < nr_channels; i++){
+        if(channels[i].stamp_pending){
+            datalog_wait(&channels[i].log, channels[i].stamp_seq);
+        }
+    }
 
     time( &rawtime );
+    if(rawtime != formatted){
+        localtime_r(&rawtime, &info);
+        len = strftime(buffer, sizeof(buffer), "timestamp:%Y%m%d%H%M%S\n", &info);
+        formatted = rawtime;
+    }
+    logger_log(LOG_DEBUG, "%.*s", (int) len - 1, buffer);
 
-    info = localtime( &rawtime );
+    // batched with client appends, no need to wait for it here
+    for (int i = 0; i < nr_channels; i++){
+        channels[i].stamp_seq = datalog_submit(&channels[i].log, buffer, len);
+        channels[i].stamp_pending = true;
+    }
+}
 
-    strftime(buffer,80,"timestamp:%Y%m%d%H%M%S\n", info);
-    printf("%s\n", buffer );
+struct response *process_packet(struct channel *channel, const char *packet, size_t len)
+{
+    const struct command *cmd;
+    uint32_t args[COMMAND_MAX_ARGS];
+    off_t offset = 0;
+    int fd;
+    uint64_t start = metrics_now();
+    int parsed = command_parse(packet, len, &cmd, args);
 
-    pthread_mutex_lock(&mutex);
-    FILE *fp = fopen(AESD_SOCKET_DATA, "a");
-    appendToFile(&fp, buffer);
-    pthread_mutex_unlock(&mutex);
+    metrics_add(METRICS_PACKETS, 1);
+    if(parsed < 0){
+        logger_log(LOG_WARNING, "Malformed command %.*s", logger_dump_len(len), packet);
+    }
+    if(!USE_AESD_CHAR_DEVICE){
+        // commands only apply to the char device, they aren't stored
+        if(parsed == 0){
+            // the snapshot must include this packet and everything before it
+            datalog_wait(&channel->log, datalog_submit(&channel->log, packet, len));
+            metrics_record_since(METRICS_APPEND, start);
+        }
+        return response_new_snapshot(&channel->log);
+    }
+
+    // the device node comes from aesdchar_load, never create a file in its place
+    fd = open(channel->path, O_RDWR | O_APPEND | O_CLOEXEC);
+    if(fd < 0){
+        logger_log(LOG_ERR, "Fail open %s %s", channel->path, strerror(errno));
+        return NULL;
+    }
+    if(parsed == 0){
+        if(write_packet(fd, packet, len) < 0){
+            close(fd);
+            return NULL;
+        }
+    }
+    else if(parsed > 0){
+        // a failed command echoes everything, as a fresh open would
+        offset = cmd->run(fd, args);
+        if(offset < 0){
+            offset = 0;
+        }
+    }
+    metrics_record_since(METRICS_APPEND, start);
+    // the response reads from its own offset, never the shared position
+    return response_new(fd, offset);
 }
 
-bool TIMER_DONE = false;
-int TIMER_SLEEP = 10;
 void *threadproc(void *arg)
 {
-    while(!TIMER_DONE)
+    int timerfd = *(int *) arg;
+
+    while(1)
     {
-        sleep(TIMER_SLEEP);
-        append_timestamp();
+        // blocks until the next deadline
+        append_timestamp(timerfd);
     }
     return 0;
 }
 
-typedef struct slist_data_s slist_data_t;
-struct slist_data_s {
-    int acceptedfd;
-    pthread_t thread;
-    bool thread_complete;
-    SLIST_ENTRY(slist_data_s) entries;
+/*
+ * A session served by a worker thread, tracked so shutdown can end its recv
+ */
+struct session {
+    int fd;
+    TAILQ_ENTRY(session) entries;
 };
 
-void *receive_data(void *args){
-    // Receives data over the connection and appends to file
-    // /var/tmp/aesdsocketdata, creating this file if it doesn't exist.
-    slist_data_t *datap = args;
-    int acceptedfd = datap->acceptedfd;
-    char* data = (char*) malloc(1);
-    memset(data, 0, 1);
-    size_t data_len = 0;
+TAILQ_HEAD(, session) sessions = TAILQ_HEAD_INITIALIZER(sessions);
+pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+bool sessions_draining = false;
+
+void session_track(struct session *session){
+    pthread_mutex_lock(&sessions_lock);
+    TAILQ_INSERT_TAIL(&sessions, session, entries);
+    if(sessions_draining){
+        shutdown(session->fd, SHUT_RD);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+void session_untrack(struct session *session){
+    // must happen before the close so draining never sees a reused fd
+    pthread_mutex_lock(&sessions_lock);
+    TAILQ_REMOVE(&sessions, session, entries);
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+/*
+ * Makes every session recv return what the client already sent and then
+ * end of file, so the sessions answer it and close.
+ */
+void sessions_drain(void){
+    struct session *session;
+
+    pthread_mutex_lock(&sessions_lock);
+    sessions_draining = true;
+    TAILQ_FOREACH(session, &sessions, entries){
+        shutdown(session->fd, SHUT_RD);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+/*
+ * A connection served by the worker pool, kept while it is parked waiting
+ * for the client to send more, for room to send its echo or for the rate
+ * limit
+ */
+struct client {
+    struct worker_conn wc;
+    char peer[INET6_ADDRSTRLEN];
+    // metrics_now() time of the accept, 0 once the first byte arrived
+    uint64_t accepted;
+    // metrics_now() time of the last recv
+    uint64_t received;
+    struct channel *channel;
+    struct framebuf fb;
+    struct session session;
+    struct ratelimit rl;
+    // echo the socket had no room for yet, sent before the next packet
+    struct response *resp;
+};
+
+struct pool client_pool = POOL_INITIALIZER(struct client);
+
+void client_free(struct client *client){
+    if(client->resp != NULL){
+        response_free(client->resp);
+    }
+    framebuf_free(&client->fb);
+    if(SESSION_MODE){
+        session_untrack(&client->session);
+    }
+    pool_free(&client_pool, client);
+}
+
+void client_close(struct client *client){
+    int fd = client->wc.fd;
+
+    // closing the connected socket
+    logger_log(LOG_INFO, "Closed connection from %s", client->peer);
+    client_free(client);
+    close(fd);
+    conn_release();
+}
+
+/*
+ * Queues the connection @param fd accepted at @param accepted from
+ * @param peer for the worker pool, which owns it on success.
+ */
+bool client_submit(int fd, const char *peer, uint64_t accepted){
+    struct client *client = pool_alloc(&client_pool);
+
+    if(client == NULL){
+        return false;
+    }
+    client->wc.fd = fd;
+    snprintf(client->peer, sizeof(client->peer), "%s", peer);
+    client->accepted = accepted;
+    client->channel = channel_of(fd);
+    client->session.fd = fd;
+    framebuf_init(&client->fb, MAX_PACKET_SIZE);
+    if(SESSION_MODE){
+        session_track(&client->session);
+    }
+    if(!workers_submit(&client->wc)){
+        client_free(client);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Closes the connection @param wc, parked for SEND_TIMEOUT seconds without
+ * room for its echo, or for SESSION_IDLE_TIMEOUT seconds without the client
+ * sending anything.
+ */
+void expire_client(struct worker_conn *wc){
+    struct client *client = (struct client *) wc;
+
+    if(client->resp != NULL){
+        logger_log(LOG_ERR, "Send to %s timed out", client->peer);
+    }
+    else{
+        logger_log(LOG_INFO, "Session from %s idle for %d seconds", client->peer, SESSION_IDLE_TIMEOUT);
+    }
+    client_close(client);
+}
+
+/*
+ * Stops serving @param client until its socket is ready for @param events,
+ * or for @param timeout nanoseconds, on a worker again.  Returns false
+ * if it couldn't be parked and has to be closed.
+ */
+bool client_park(struct client *client, uint32_t events, uint64_t timeout){
+    client->wc.events = events;
+    client->wc.deadline = timeout != 0 ? metrics_now() + timeout : 0;
+    if(workers_park(&client->wc)){
+        return true;
+    }
+    logger_log(LOG_ERR, "Can't park the connection from %s", client->peer);
+    return false;
+}
+
+void receive_data(struct worker_conn *wc){
+    // Receives data over the connection and appends to the backing store
+    // of the channel it was accepted for, until the client has nothing
+    // more to send for now.  Whatever has to wait parks the connection
+    // rather than the worker.
+    struct client *client = (struct client *) wc;
+    int acceptedfd = wc->fd;
+    const char *peer = client->peer;
     int BUF_SIZE = 1024;
-    char* buffer = (char*) malloc(BUF_SIZE);
-    memset(buffer, 0, BUF_SIZE);
-    ssize_t valread = 0;
-    bool recv_data = true;
-    while (recv_data){
-        valread = recv(acceptedfd, buffer, BUF_SIZE, 0);
-        if(valread < 0){
+
+    if(client->channel == NULL){
+        logger_log(LOG_ERR, "No channel for the connection from %s", peer);
+        client_close(client);
+        return;
+    }
+    while (1){
+        if(client->resp != NULL){
+            int rc = response_send(client->resp, acceptedfd);
+            if(rc == 0){
+                // a client not reading its echo times out while parked
+                if(client_park(client, EPOLLOUT, (uint64_t) SEND_TIMEOUT * 1000000000)){
+                    return;
+                }
+                break;
+            }
+            response_cork(acceptedfd, false);
+            metrics_record_since(METRICS_PACKET, client->resp->received);
+            response_free(client->resp);
+            client->resp = NULL;
+            if(rc < 0){
+                logger_log(LOG_ERR, "Error sending to %s", peer);
+                break;
+            }
+            if(!SESSION_MODE){
+                // one packet per connection
+                break;
+            }
+        }
+
+        // every packet completed so far is handled before reading more
+        const char *packet;
+        size_t packet_len;
+        if((packet = framebuf_next_packet(&client->fb, &packet_len)) != NULL){
+            uint64_t wait = RATE_LIMIT > 0 ? ratelimit_take(&client->rl, RATE_LIMIT, metrics_now()) : 0;
+            if(wait > 0){
+                // the packet waits in the buffer, the client's further
+                // ones queue in the socket buffer meanwhile
+                framebuf_unread(&client->fb, packet_len);
+                if(client_park(client, 0, wait)){
+                    return;
+                }
+                break;
+            }
+            logger_log(LOG_DEBUG, "Found word: %.*s", logger_dump_len(packet_len), packet);
+            client->resp = process_packet(client->channel, packet, packet_len);
+            if(client->resp == NULL){
+                if(!SESSION_MODE){
+                    break;
+                }
+                continue;
+            }
+            client->resp->received = client->received;
+            response_cork(acceptedfd, true);
+            continue;
+        }
+        if(client->fb.overflow){
+            logger_log(LOG_WARNING, "Packet from %s over %zu bytes, closing", peer, MAX_PACKET_SIZE);
+            break;
+        }
+
+        size_t avail;
+        char *buffer = framebuf_reserve(&client->fb, BUF_SIZE, &avail);
+        if(buffer == NULL){
+            logger_log(LOG_ERR, "Out of memory receiving from %s", peer);
             break;
         }
-        if(valread == 0){
+        ssize_t valread = recv(acceptedfd, buffer, avail, 0);
+        if(valread < 0 && errno == EINTR){
             continue;
         }
-        data_len += valread;
-        data = (char *) realloc(data, (data_len + valread)+1);
-        if(data == NULL){
-            printf("DATA NOT ALLOCATED!");
-            exit(0);
+        if(valread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            // an idle client doesn't hold on to the worker, it is queued
+            // again once it sends more, or expires as an idle session
+            if(client_park(client, EPOLLIN, SESSION_MODE ? (uint64_t) SESSION_IDLE_TIMEOUT * 1000000000 : 0)){
+                return;
+            }
+            break;
         }
-        else{
-            // printf("valread %ld = data_len %ld\n", valread, data_len);
-        }
-        for (ssize_t i = 0; i < valread; i++)
-        {
-            char c = buffer[i];
-            char tmpstr[2];
-            tmpstr[0] = c;
-            tmpstr[1] = 0;
-
-            strcat (data, tmpstr);
-            if (c == '\n')
-            {
-                printf("Found word: %s", data);
-                recv_data=false;
-
-                FILE * fp;
-                char * line = NULL;
-                size_t len = 0;
-                ssize_t read;
+        if(valread <= 0){
+            break;
+        }
+        client->received = metrics_now();
+        if(client->accepted != 0){
+            metrics_record(METRICS_FIRST_BYTE, client->received - client->accepted);
+            client->accepted = 0;
+        }
+        metrics_add(METRICS_BYTES_IN, valread);
+        framebuf_commit(&client->fb, valread);
+    }
+    client_close(client);
+}
 
-                if(USE_AESD_CHAR_DEVICE){
-                    fp = fopen(AESD_CHAR_DEVICE, "a+");
-                    appendToFile(&fp, data);
-                }
-                else{
-                    pthread_mutex_lock(&mutex);
-                    fp = fopen(AESD_SOCKET_DATA, "a+");
-                    appendToFile(&fp, data);
-                    pthread_mutex_unlock(&mutex);
-                }
+/*
+ * A listening socket and its accept thread
+ */
+struct listener {
+    int fd;
+    pthread_t thread;
+};
 
-                // if(USE_AESD_CHAR_DEVICE){
-                //     fp = fopen(AESD_CHAR_DEVICE, "r");
-                // }
-                // else{
-                //     fp = fopen(AESD_SOCKET_DATA, "r");
-                // }
-                if (fp == NULL)
-                    exit(EXIT_FAILURE);
-
-                while ((read = getline(&line, &len, fp)) != -1) {
-                    // printf("read = %ld\n", read);
-                    // printf("acceptedfd = %d\n", acceptedfd);
-                    // printf("sending: %s", line);
-                    ssize_t size_sent = send(acceptedfd, line, read, 0);
-                    if(size_sent == -1){
-                        printf("ERROR SENDING\n");
-                    }
-                    else{
-                        // printf("Sent = %ld\n", size_sent);
-                    }
-                }
-                fclose(fp);
-                free(line);
-                break;
+struct listener *listeners;
+int nr_listeners;
+bool REACTOR_MODE = false;
+bool URING_MODE = false;
+
+int SHUTDOWN_TIMEOUT = 5;
+// interval at which shutdown checks whether the connections drained
+#define SHUTDOWN_POLL_NS 10000000
+
+// readable once the accept threads should stop
+int stop_fd = -1;
+bool stopping = false;
+
+const char *HANDOFF_PATH = NULL;
+#define HANDOFF_MAX_LISTENERS 64
+
+/*
+ * Stops accepting, gives the connections in flight up to SHUTDOWN_TIMEOUT
+ * seconds to finish and exits with @param status.  Idle sessions are
+ * closed right away.  After a handoff the data file and the handoff socket
+ * belong to the new instance and are left alone.
+ */
+void shutdown_server(int status, bool handoff){
+    struct timespec now, deadline;
+    int open_conns;
+
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    eventfd_write(stop_fd, 1);
+    if(URING_MODE){
+        uring_drain();
+    }
+    else if(REACTOR_MODE){
+        reactor_drain();
+    }
+    else if(SESSION_MODE){
+        sessions_drain();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += SHUTDOWN_TIMEOUT;
+    while ((open_conns = __atomic_load_n(&active_conns, __ATOMIC_ACQUIRE)) > 0){
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if(now.tv_sec > deadline.tv_sec ||
+           (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)){
+            logger_log(LOG_INFO, "Closing %d connections still open", open_conns);
+            break;
+        }
+        nanosleep(&(struct timespec){ .tv_nsec = SHUTDOWN_POLL_NS }, NULL);
+    }
+
+    if(!handoff){
+        for (int i = 0; i < nr_channels && !USE_AESD_CHAR_DEVICE; i++){
+            if (remove(channels[i].path) == 0){
+                logger_log(LOG_INFO, "Deleted successfully");
+            }
+            else{
+                logger_log(LOG_INFO, "Unable to delete the file");
             }
         }
-        memset(buffer, 0, BUF_SIZE);
+        if(HANDOFF_PATH != NULL){
+            unlink(HANDOFF_PATH);
+        }
     }
-    free(buffer);
-    free(data);
-    datap->thread_complete = true;
+    exit(status);
+}
+
+/*
+ * Takes over the listening sockets of the instance serving the handoff
+ * socket at @param path, which then stops accepting and drains.  Returns
+ * the connection to the old instance, which reaches end of file once it
+ * exited, or -1 if there is no instance to take over from.
+ */
+int receive_listeners(const char *path){
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char data;
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_LISTENERS)];
+    struct iovec iov = { .iov_base = &data, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
 
-    return args;
+    if(fd < 0){
+        perror("socket failed");
+        return -1;
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0){
+        close(fd);
+        return -1;
+    }
+
+    if(recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) <= 0 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+       cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS){
+        fprintf(stderr, "No listeners handed over on %s\n", path);
+        close(fd);
+        return -1;
+    }
+    nr_listeners = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    listeners = calloc(nr_listeners, sizeof(*listeners));
+    if(listeners == NULL){
+        close(fd);
+        return -1;
+    }
+    for (int i = 0; i < nr_listeners; i++){
+        memcpy(&listeners[i].fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+    }
+    printf("Took over %d listeners\n", nr_listeners);
+    return fd;
 }
 
-int sockfd;
-struct addrinfo *servinfo;
-SLIST_HEAD(slisthead, slist_data_s) head;
-void sig_handler(int signum){
-    syslog(LOG_INFO, "Caught signal, exiting\n");
-    printf("Caught signal, exiting\n");
+/*
+ * Passes the listening sockets to the instance connecting to
+ * @param handoff_fd.  Returns the connection, which has to stay open until
+ * this instance exits, or -1.
+ */
+int send_listeners(int handoff_fd){
+    char data = 0;
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_LISTENERS)];
+    struct iovec iov = { .iov_base = &data, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * nr_listeners),
+    };
+    struct cmsghdr *cmsg;
+    int fd = accept4(handoff_fd, NULL, NULL, SOCK_CLOEXEC);
 
-    if (remove("/var/tmp/aesdsocketdata") == 0){
-        printf("Deleted successfully\n");
+    if(fd < 0){
+        return -1;
     }
-    else{
-        printf("Unable to delete the file\n");
+    memset(control, 0, sizeof(control));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nr_listeners);
+    for (int i = 0; i < nr_listeners; i++){
+        memcpy(CMSG_DATA(cmsg) + i * sizeof(int), &listeners[i].fd, sizeof(int));
+    }
+    if(sendmsg(fd, &msg, MSG_NOSIGNAL) < 0){
+        perror("sendmsg");
+        close(fd);
+        return -1;
     }
+    return fd;
+}
+
+/*
+ * Opens the handoff socket at @param path, replacing the one of an
+ * instance which exited or just handed over.
+ */
+int open_handoff(const char *path){
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
 
-    // delete list
-    slist_data_t *datap=NULL;
-    while (!SLIST_EMPTY(&head)) {
-        datap = SLIST_FIRST(&head);
-        pthread_join(datap->thread, NULL);
-        SLIST_REMOVE_HEAD(&head, entries);
-        free(datap);
+    if(fd < 0){
+        perror("socket failed");
+        return -1;
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+    if(bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 1) < 0){
+        perror("handoff socket");
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    // closing the listening socket
-    freeaddrinfo(servinfo);
-    shutdown(sockfd, SHUT_RDWR);
-    exit(signum);
+// a plain client sends nothing, give an HTTP request this long to arrive
+#define METRICS_REQUEST_TIMEOUT_MS 100
+#define METRICS_REQUEST_MAX 4096
+// give the scraper this long to read the reply, the thread serves no one else meanwhile
+#define METRICS_REPLY_TIMEOUT_MS 1000
+
+/*
+ * Waits for @param events on @param fd until @param deadline, a
+ * metrics_now() time.
+ * @return true if they came in time.
+ */
+bool poll_until(int fd, short events, uint64_t deadline){
+    struct pollfd pfd = { .fd = fd, .events = events };
+    uint64_t now;
+    int rc;
+
+    do {
+        now = metrics_now();
+        if(now >= deadline){
+            return false;
+        }
+        // rounded up so the last wait doesn't spin
+        rc = poll(&pfd, 1, (int) ((deadline - now + 999999) / 1000000));
+    } while (rc < 0 && errno == EINTR);
+    return rc > 0;
 }
 
-int main(int argc, char *argv[])
-{
-    signal(SIGINT, sig_handler);
-    signal(SIGTERM, sig_handler);
-    bool daemon_mode = false;
-    if(argc == 2){
-        if (strcmp(argv[1], "-d") == 0)
-        {
-            daemon_mode = true;
+/*
+ * Writes the metrics to the scraping client @param fd and closes it.  HTTP
+ * requests get an HTTP response so Prometheus can scrape the endpoint.
+ * The reply is rendered first and sent without blocking, so a client that
+ * dawdles over its request or never reads can't hold up the next scrape.
+ */
+void serve_scrape(int fd){
+    char request[METRICS_REQUEST_MAX];
+    size_t len = 0;
+    uint64_t deadline = metrics_now() + (uint64_t) METRICS_REQUEST_TIMEOUT_MS * 1000000;
+    char *reply = NULL;
+    size_t reply_len = 0;
+    size_t sent = 0;
+    FILE *out;
+
+    request[0] = '\0';
+    while (len < sizeof(request) - 1 && poll_until(fd, POLLIN, deadline)){
+        ssize_t n = recv(fd, request + len, sizeof(request) - 1 - len, MSG_DONTWAIT);
+        if(n <= 0){
+            break;
         }
+        len += n;
+        request[len] = '\0';
+        if(strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL){
+            break;
+        }
+    }
+
+    out = open_memstream(&reply, &reply_len);
+    if(out == NULL){
+        close(fd);
+        return;
+    }
+    if(strncmp(request, "GET ", 4) == 0){
+        fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n");
+    }
+    metrics_write(out, __atomic_load_n(&active_conns, __ATOMIC_RELAXED));
+    if(fclose(out) == 0){
+        deadline = metrics_now() + (uint64_t) METRICS_REPLY_TIMEOUT_MS * 1000000;
+        while (sent < reply_len){
+            ssize_t n = send(fd, reply + sent, reply_len - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if(n > 0){
+                sent += n;
+            }
+            else if(n < 0 && errno == EINTR){
+                continue;
+            }
+            else if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) ||
+                    !poll_until(fd, POLLOUT, deadline)){
+                break;
+            }
+        }
+    }
+    free(reply);
+    close(fd);
+}
+
+void *metrics_loop(void *arg){
+    int listen_fd = *(int *) arg;
+    struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+
+    while (1){
+        if(poll(&pfd, 1, -1) < 0){
+            continue;
+        }
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if(fd >= 0){
+            serve_scrape(fd);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Serves shutdown signals and handoff requests, on the main thread so
+ * nothing runs in signal context.  Never returns.
+ */
+void control_loop(int sigfd, int handoff_fd){
+    // poll skips the handoff entry when there is no handoff socket
+    struct pollfd pfds[2] = {
+        { .fd = sigfd, .events = POLLIN },
+        { .fd = handoff_fd, .events = POLLIN },
+    };
+
+    while (1){
+        if(poll(pfds, 2, -1) < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("poll");
+            exit(-1);
+        }
+        if(pfds[0].revents & POLLIN){
+            struct signalfd_siginfo info;
+            if(read(sigfd, &info, sizeof(info)) == sizeof(info)){
+                logger_log(LOG_INFO, "Caught signal, exiting");
+                shutdown_server(info.ssi_signo, false);
+            }
+        }
+        if(pfds[1].revents & POLLIN && send_listeners(handoff_fd) >= 0){
+            logger_log(LOG_INFO, "Handed listeners over, exiting");
+            close(handoff_fd);
+            shutdown_server(0, true);
+        }
+    }
+}
+
+void format_peer(const struct sockaddr_storage *addr, char *peer, size_t len){
+    if(addr->ss_family == AF_INET6){
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) addr;
+        inet_ntop(AF_INET6, &in6->sin6_addr, peer, len);
+    }
+    else{
+        const struct sockaddr_in *in = (const struct sockaddr_in *) addr;
+        inet_ntop(AF_INET, &in->sin_addr, peer, len);
+    }
+}
+
+/*
+ * Creates, binds and listens on a socket for the address @param p.
+ * Returns the socket or -1.
+ */
+int bind_listener(const struct addrinfo *p, int backlog, bool reuseport){
+    // non-blocking so the accept loop can drain the backlog in batches
+    int fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+    if (fd == -1) {
+        perror("socket failed");
+        return -1;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0){
+        perror("setsockopt(SO_REUSEADDR) failed");
+    }
+    // every listener binds the same port, the kernel spreads connections
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0){
+        perror("setsockopt(SO_REUSEPORT) failed");
+        close(fd);
+        return -1;
+    }
+    // accept IPv4 clients on an IPv6 socket as mapped addresses
+    if (p->ai_family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &(int){0}, sizeof(int)) < 0){
+        perror("setsockopt(IPV6_V6ONLY) failed");
+    }
 
+    if (bind(fd, p->ai_addr, p->ai_addrlen) < 0) {
+        perror("bind failed");
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, backlog) < 0) {
+        perror("listen");
+        close(fd);
+        return -1;
     }
-    // Opens a stream socket bound to port 9000, failing and returning -1 if any of
-    // the socket connection steps fail.
+    return fd;
+}
 
-    // bind to port 9000
+/*
+ * Opens a stream socket listening on @param addr and @param port.  Without
+ * an address a dual stack IPv6 socket is preferred over an IPv4 only one.
+ * Returns the socket or -1 if any of the socket connection steps fail.
+ */
+int open_listener(const char *addr, const char *port, int backlog, bool reuseport){
     int status;
+    int fd = -1;
     struct addrinfo hints;
+    struct addrinfo *servinfo, *p;
 
     memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET;
+    hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
 
-    if((status = getaddrinfo(NULL, "9000", &hints, &servinfo)) != 0){
+    if((status = getaddrinfo(addr, port, &hints, &servinfo)) != 0){
         printf("getaddrinfo error: %s\n", gai_strerror(status));
+        return -1;
     }
 
-
-    // Create a socket file descriptor
-    if ((sockfd = socket(servinfo->ai_family, servinfo->ai_socktype, 0)) == -1) {
-        perror("socket failed");
-        return -1;
+    for (int pass = 0; pass < 2 && fd < 0; pass++){
+        for (p = servinfo; p != NULL && fd < 0; p = p->ai_next){
+            if(addr == NULL && (p->ai_family == AF_INET6) != (pass == 0)){
+                continue;
+            }
+            if(addr != NULL && pass == 1){
+                break;
+            }
+            fd = bind_listener(p, backlog, reuseport);
+        }
     }
 
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0){
-        perror("setsockopt(SO_REUSEADDR) failed");
+    freeaddrinfo(servinfo);
+    return fd;
+}
+
+void *accept_loop(void *arg){
+    struct listener *listener = arg;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    char peer[INET6_ADDRSTRLEN];
+    int acceptedfd;
+    // neither the reactor nor the workers block on a connection
+    int flags = SOCK_CLOEXEC | SOCK_NONBLOCK;
+    struct pollfd pfds[2] = {
+        { .fd = listener->fd, .events = POLLIN },
+        { .fd = stop_fd, .events = POLLIN },
+    };
+
+    while (1)
+    {
+        if (poll(pfds, 2, -1) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(-1);
+        }
+        if (pfds[1].revents & POLLIN){
+            // shutting down, whatever is left in the backlog stays there
+            return NULL;
+        }
+
+        // take every pending connection off the backlog
+        while (1){
+            // when queueing, leave connections in the backlog until one closes
+            if(!SHED_LOAD){
+                conn_admit();
+                if(__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)){
+                    conn_release();
+                    return NULL;
+                }
+            }
+            addrlen = sizeof(addr);
+            acceptedfd = accept4(listener->fd, (struct sockaddr *) &addr, &addrlen, flags);
+            if (acceptedfd < 0) {
+                if(!SHED_LOAD){
+                    conn_release();
+                }
+                if(errno == EAGAIN || errno == EWOULDBLOCK){
+                    break;
+                }
+                if(errno == EINTR || errno == ECONNABORTED){
+                    continue;
+                }
+                perror("accept");
+                exit(-1);
+            }
+            uint64_t accepted = metrics_now();
+            format_peer(&addr, peer, sizeof(peer));
+
+            if(SHED_LOAD && !conn_admit()){
+                // reset rather than leave the client waiting for a response
+                setsockopt(acceptedfd, SOL_SOCKET, SO_LINGER,
+                           &(struct linger){ .l_onoff = 1, .l_linger = 0 }, sizeof(struct linger));
+                close(acceptedfd);
+                logger_log(LOG_INFO, "Rejected connection from %s", peer);
+                metrics_add(METRICS_REJECTED, 1);
+                continue;
+            }
+            metrics_add(METRICS_ACCEPTED, 1);
+
+            logger_log(LOG_INFO, "Accepted connection from %s", peer);
+            if(!(REACTOR_MODE ? reactor_add(acceptedfd, peer, accepted) : client_submit(acceptedfd, peer, accepted))){
+                close(acceptedfd);
+                conn_release();
+            }
+        }
     }
+    return NULL;
+}
 
-    int bindrv = bind(sockfd, servinfo->ai_addr, servinfo->ai_addrlen);
-    if (bindrv < 0) {
-        perror("bind failed");
+int main(int argc, char *argv[])
+{
+    // shutdown signals are read from a signalfd, every thread blocks them
+    sigset_t shutdown_signals;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, NULL);
+    bool daemon_mode = false;
+    const char *bind_addr = NULL;
+    const char *port = "9000";
+    int nr_chans = 1;
+    int backlog = SOMAXCONN;
+    int nr_workers = 0;
+    const char *metrics_port = NULL;
+    int handoff_conn = -1;
+    int opt;
+    nr_listeners = 1;
+    while ((opt = getopt(argc, argv, "deusi:a:p:C:b:r:c:xl:R:T:w:t:k:K:g:H:m:v")) != -1){
+        switch (opt){
+            case 'd':
+                daemon_mode = true;
+                break;
+            case 'e':
+                // serve connections from epoll event loops, one per cpu
+                REACTOR_MODE = true;
+                break;
+            case 'u':
+                // serve connections from io_uring loops, falling back to epoll
+                URING_MODE = true;
+                break;
+            case 's':
+                // keep connections open for any number of packets
+                SESSION_MODE = true;
+                break;
+            case 'i':
+                SESSION_IDLE_TIMEOUT = atoi(optarg);
+                if(SESSION_IDLE_TIMEOUT <= 0){
+                    fprintf(stderr, "Invalid idle timeout %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'a':
+                bind_addr = optarg;
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            case 'C':
+                // channel n is served on port + n with a store of its own
+                nr_chans = atoi(optarg);
+                if(nr_chans <= 0 || nr_chans > CHANNEL_MAX){
+                    fprintf(stderr, "Invalid number of channels %s\n", optarg);
+                    return -1;
+                }
+                // the driver registers a single device
+                if(USE_AESD_CHAR_DEVICE && nr_chans > 1){
+                    fprintf(stderr, "Channels need the data file, %s is the only char device\n", AESD_CHAR_DEVICE);
+                    return -1;
+                }
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                if(backlog <= 0){
+                    fprintf(stderr, "Invalid backlog %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'r':
+                // SO_REUSEPORT listeners, each with its own accept thread
+                nr_listeners = atoi(optarg);
+                if(nr_listeners <= 0){
+                    fprintf(stderr, "Invalid number of listeners %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'c':
+                MAX_CONNECTIONS = atoi(optarg);
+                if(MAX_CONNECTIONS <= 0){
+                    fprintf(stderr, "Invalid connection limit %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'x':
+                // over the connection limit reject clients instead of queueing them
+                SHED_LOAD = true;
+                break;
+            case 'l':
+                // longest packet accepted, in bytes
+                if(atol(optarg) <= 0){
+                    fprintf(stderr, "Invalid packet size limit %s\n", optarg);
+                    return -1;
+                }
+                MAX_PACKET_SIZE = atol(optarg);
+                break;
+            case 'R':
+                // packets per second processed for each connection
+                if(atoi(optarg) <= 0){
+                    fprintf(stderr, "Invalid rate limit %s\n", optarg);
+                    return -1;
+                }
+                RATE_LIMIT = atoi(optarg);
+                break;
+            case 'T':
+                // seconds an echo may go without progress
+                SEND_TIMEOUT = atoi(optarg);
+                if(SEND_TIMEOUT < 0){
+                    fprintf(stderr, "Invalid send timeout %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'w':
+                // worker threads serving connections, one per cpu by default
+                nr_workers = atoi(optarg);
+                if(nr_workers <= 0){
+                    fprintf(stderr, "Invalid number of workers %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 't':
+                TIMESTAMP_PERIOD = atoi(optarg);
+                if(TIMESTAMP_PERIOD <= 0){
+                    fprintf(stderr, "Invalid timestamp period %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'k':
+                // the data file only, the char device keeps its own window
+                if(USE_AESD_CHAR_DEVICE){
+                    fprintf(stderr, "-k only applies to the data file, set the char device's buffer_depth instead\n");
+                    return -1;
+                }
+                RETAIN_LINES = atol(optarg);
+                if(RETAIN_LINES < 0){
+                    fprintf(stderr, "Invalid number of lines to keep %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'K':
+                if(USE_AESD_CHAR_DEVICE){
+                    fprintf(stderr, "-K only applies to the data file, set the char device's buffer_depth instead\n");
+                    return -1;
+                }
+                RETAIN_BYTES = atol(optarg);
+                if(RETAIN_BYTES < 0){
+                    fprintf(stderr, "Invalid number of bytes to keep %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'g':
+                // seconds connections in flight get to finish on shutdown
+                SHUTDOWN_TIMEOUT = atoi(optarg);
+                if(SHUTDOWN_TIMEOUT < 0){
+                    fprintf(stderr, "Invalid shutdown timeout %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'H':
+                // unix socket a new instance takes the listeners over from
+                HANDOFF_PATH = optarg;
+                if(strlen(HANDOFF_PATH) >= sizeof(((struct sockaddr_un *) 0)->sun_path)){
+                    fprintf(stderr, "Handoff socket path too long %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'm':
+                // serve metrics on this port of the loopback interface
+                metrics_port = optarg;
+                break;
+            case 'v':
+                // log packets and seek commands too
+                logger_level = LOG_DEBUG;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-d] [-e] [-u] [-s] [-i idle_timeout] [-a address] [-p port] [-C channels] [-b backlog] [-r listeners] [-c max_connections] [-x] [-l max_packet_size] [-R rate_limit] [-T send_timeout] [-w workers] [-t timestamp_period] [-k keep_lines] [-K keep_bytes] [-g shutdown_timeout] [-H handoff_socket] [-m metrics_port] [-v]\n", argv[0]);
+                return -1;
+        }
+    }
+    if(HANDOFF_PATH != NULL && nr_listeners * nr_chans > HANDOFF_MAX_LISTENERS){
+        fprintf(stderr, "At most %d listeners can be handed over\n", HANDOFF_MAX_LISTENERS);
+        return -1;
+    }
+    if(channels_init(nr_chans, USE_AESD_CHAR_DEVICE ? AESD_CHAR_DEVICE : AESD_SOCKET_DATA, port) < 0){
         return -1;
     }
 
-    if(daemon_mode && bindrv == 0){
+    // an instance already running hands its listeners over, so no
+    // connection is refused while the two swap
+    if(HANDOFF_PATH != NULL){
+        handoff_conn = receive_listeners(HANDOFF_PATH);
+    }
+    if(handoff_conn < 0){
+        listeners = calloc(nr_listeners * nr_channels, sizeof(*listeners));
+        if(listeners == NULL){
+            return -1;
+        }
+        // every channel gets the same number of listeners on its own port
+        for (int i = 0; i < nr_listeners * nr_channels; i++){
+            char chan_port[8];
+            snprintf(chan_port, sizeof(chan_port), "%d", channels[i / nr_listeners].port);
+            listeners[i].fd = open_listener(bind_addr, nr_channels > 1 ? chan_port : port, backlog,
+                                            nr_listeners > 1);
+            if(listeners[i].fd < 0){
+                return -1;
+            }
+        }
+        nr_listeners *= nr_channels;
+    }
+
+    if(daemon_mode){
         int pid = fork();
         if(pid > 0){
             exit(0);
         }
     }
 
-    // start timer
-    if(!USE_AESD_CHAR_DEVICE){
-        pthread_t tid;
-        pthread_create(&tid, NULL, &threadproc, NULL);
+    // after the fork, the parent must not flush what the child will, and
+    // without the logger thread records are written as they are logged
+    logger_start();
+
+    if(handoff_conn >= 0){
+        // the old instance still appends while it drains, load the data
+        // file only once it exited.  Clients queue in the shared backlog.
+        char eof;
+        ssize_t rc;
+        do {
+            rc = USE_AESD_CHAR_DEVICE ? 0 : read(handoff_conn, &eof, 1);
+        } while (rc > 0 || (rc < 0 && errno == EINTR));
+        close(handoff_conn);
     }
 
-    int acceptedfd;
-    char ipv4[INET_ADDRSTRLEN];
-    // Listens for and accepts a connection
-    if (listen(sockfd, 3) < 0) {
-        perror("listen");
+    for (int i = 0; i < nr_channels && !USE_AESD_CHAR_DEVICE; i++){
+        if(datalog_open(&channels[i].log, channels[i].path, RETAIN_LINES, RETAIN_BYTES) < 0){
+            return -1;
+        }
+    }
+
+    int sigfd = signalfd(-1, &shutdown_signals, SFD_CLOEXEC);
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if(sigfd < 0 || stop_fd < 0){
+        perror("signalfd");
+        return -1;
+    }
+    int handoff_fd = -1;
+    if(HANDOFF_PATH != NULL && (handoff_fd = open_handoff(HANDOFF_PATH)) < 0){
         return -1;
     }
 
-    SLIST_INIT(&head);
-    slist_data_t *datap=NULL;
+    // io_uring loops accept connections themselves as soon as they start
+    if(URING_MODE){
+        int listen_fds[nr_listeners];
+        for (int i = 0; i < nr_listeners; i++){
+            listen_fds[i] = listeners[i].fd;
+        }
+        if(!uring_start(0, listen_fds, nr_listeners)){
+            printf("io_uring not supported, using epoll\n");
+            URING_MODE = false;
+            REACTOR_MODE = true;
+        }
+    }
+    if(REACTOR_MODE && !reactor_start(0)){
+        return -1;
+    }
 
-    while (1)
-    {
-        if ((acceptedfd = accept(sockfd, servinfo->ai_addr, &servinfo->ai_addrlen)) < 0) {
-            perror("accept");
+    // start timer, the reactor serves it from one of its event loops
+    int timerfd;
+    if(!USE_AESD_CHAR_DEVICE){
+        if((timerfd = open_timestamp_timer(REACTOR_MODE)) < 0){
             return -1;
         }
-        syslog(LOG_INFO, "Accepted connection from %s\n", inet_ntop(AF_INET, &servinfo, ipv4, INET_ADDRSTRLEN));
-        printf("Accepted connection from %s\n", inet_ntop(AF_INET, &servinfo, ipv4, INET_ADDRSTRLEN));
-
-        datap = malloc(sizeof(slist_data_t));
-        datap->acceptedfd = acceptedfd;
-        datap->thread_complete = false;
-
-        SLIST_INSERT_HEAD(&head, datap, entries);
-
-        pthread_create(&datap->thread, NULL, receive_data, (void*) datap);
-        // openFile("/var/tmp/aesdsocketdata", acceptedfd);
-
-        // remove
-        slist_data_t *np_temp = NULL;
-        SLIST_FOREACH_SAFE(datap, &head, entries, np_temp){
-            if(datap->thread_complete){
-                // closing the connected socket
-                close(datap->acceptedfd);
-                syslog(LOG_INFO, "Closed connection from %s\n", inet_ntop(AF_INET, &servinfo, ipv4, INET_ADDRSTRLEN));
-                printf("Closed connection from %s\n", inet_ntop(AF_INET, &servinfo, ipv4, INET_ADDRSTRLEN));
-                pthread_join(datap->thread, NULL);
-                SLIST_REMOVE(&head, datap, slist_data_s, entries);
-                free(datap);
+        if(REACTOR_MODE){
+            if(!reactor_add_timer(timerfd, append_timestamp)){
+                return -1;
             }
         }
+        else{
+            pthread_t tid;
+            pthread_create(&tid, NULL, &threadproc, &timerfd);
+        }
     }
-
-    if (remove("/var/tmp/aesdsocketdata") == 0){
-        printf("Deleted successfully\n");
+    if(!URING_MODE && !REACTOR_MODE && !workers_start(nr_workers, receive_data, expire_client)){
+        return -1;
     }
-    else{
-        printf("Unable to delete the file\n");
+
+    int metrics_fd;
+    if(metrics_port != NULL){
+        // shares the port with an instance handing over to this one
+        if((metrics_fd = open_listener("localhost", metrics_port, backlog, true)) < 0){
+            return -1;
+        }
+        pthread_t tid;
+        pthread_create(&tid, NULL, metrics_loop, &metrics_fd);
     }
 
+    // one accept thread per listener, io_uring loops accept themselves
+    for (int i = 0; i < nr_listeners && !URING_MODE; i++){
+        if(pthread_create(&listeners[i].thread, NULL, accept_loop, &listeners[i]) != 0){
+            perror("pthread_create");
+            return -1;
+        }
+    }
+    control_loop(sigfd, handoff_fd);
     return 0;
 }
@@ -0,0 +1,82 @@
+/*
+ * aesdsocket.h
+ *
+ *  @brief Declarations shared between the aesdsocket accept loop and the
+ *  connection handlers (thread per connection and epoll reactor).
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include "response.h"
+
+/**
+ * When set a connection is kept open after each echo so clients can send
+ * any number of packets over it, and is closed after SESSION_IDLE_TIMEOUT
+ * seconds without activity.
+ */
+extern bool SESSION_MODE;
+extern int SESSION_IDLE_TIMEOUT;
+
+/**
+ * Limit on concurrently served connections, 0 for no limit.  Connections
+ * over the limit wait in the listen backlog, or are reset when SHED_LOAD
+ * is set.
+ */
+extern int MAX_CONNECTIONS;
+extern bool SHED_LOAD;
+
+/**
+ * Limits on what a single client may cost, 0 disabling each.  A client
+ * sending a packet longer than MAX_PACKET_SIZE bytes is cut off.  At most
+ * RATE_LIMIT packets per second are processed for each connection, in
+ * bursts of up to a second's worth, the rest wait in the socket buffer.  A
+ * connection whose echo made no progress for SEND_TIMEOUT seconds is
+ * closed.
+ */
+extern size_t MAX_PACKET_SIZE;
+extern unsigned RATE_LIMIT;
+extern int SEND_TIMEOUT;
+
+// responses queued on a connection before it stops reading more packets
+#define CONN_MAX_QUEUED 64
+
+/**
+ * Takes a slot for a new connection, waiting for one to free up unless
+ * SHED_LOAD is set.
+ * @return false if the connection should be rejected.
+ */
+bool conn_admit(void);
+
+/**
+ * Like conn_admit but never waits, for callers which must not block.
+ * @return false if the connection is over the limit and should be rejected.
+ */
+bool conn_try_admit(void);
+
+/**
+ * Gives back the slot of a closed connection.
+ */
+void conn_release(void);
+
+/**
+ * Formats the address of @param addr into @param peer for logging.
+ */
+void format_peer(const struct sockaddr_storage *addr, char *peer, size_t len);
+
+struct channel;
+
+/**
+ * Appends the newline terminated @param packet of @param len bytes to the
+ * backing store (data log or aesdchar device) of @param channel, or runs it
+ * if it is a command, and returns the response echoing the store back to
+ * the client: all of it after a write, from the resulting offset after a
+ * seek command.  The caller sends and frees the response.
+ * @return the response, or NULL if no response could be built.
+ */
+struct response *process_packet(struct channel *channel, const char *packet, size_t len);
+
+#endif /* AESDSOCKET_H */
@@ -0,0 +1,66 @@
+/**
+ * @file channel.c
+ * @brief Channels and the ports they are served on
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "channel.h"
+
+struct channel *channels;
+int nr_channels;
+
+int channels_init(int n, const char *path, const char *port)
+{
+    char *end;
+    long base = strtol(port, &end, 10);
+
+    if(*port == '\0' || *end != '\0' || base <= 0 || base + n - 1 > 65535){
+        if(n > 1){
+            fprintf(stderr, "Channels need a port number, not %s\n", port);
+            return -1;
+        }
+        base = 0;
+    }
+    channels = calloc(n, sizeof(*channels));
+    if(channels == NULL){
+        return -1;
+    }
+    for (int i = 0; i < n; i++){
+        struct channel *channel = &channels[i];
+        int rc = i == 0 ? asprintf(&channel->path, "%s", path) :
+                          asprintf(&channel->path, "%s%d", path, i);
+        if(rc < 0){
+            return -1;
+        }
+        channel->id = i;
+        channel->port = base == 0 ? 0 : base + i;
+    }
+    nr_channels = n;
+    return 0;
+}
+
+struct channel *channel_of(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    int port;
+
+    // a single channel serves every listener, spare the system call
+    if(nr_channels == 1){
+        return &channels[0];
+    }
+    if(getsockname(fd, (struct sockaddr *) &addr, &addrlen) < 0){
+        return NULL;
+    }
+    port = ntohs(addr.ss_family == AF_INET6 ? ((struct sockaddr_in6 *) &addr)->sin6_port :
+                                              ((struct sockaddr_in *) &addr)->sin_port);
+    // listeners handed over by an instance serving other channels
+    if(port < channels[0].port || port >= channels[0].port + nr_channels){
+        return NULL;
+    }
+    return &channels[port - channels[0].port];
+}
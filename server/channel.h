@@ -0,0 +1,62 @@
+/*
+ * channel.h
+ *
+ *  @brief Independent streams served by one aesdsocket.  Channel n listens
+ *  on the base port plus n and has a backing store of its own, a data log
+ *  with its own writer thread and file.  The aesdchar driver registers a
+ *  single device, so a build for it serves one channel.  Connections on
+ *  different channels share no lock or writer, so unrelated streams scale
+ *  across cores.
+ */
+
+#ifndef AESDSOCKET_CHANNEL_H
+#define AESDSOCKET_CHANNEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "datalog.h"
+
+// channels one instance serves at most, a writer thread each
+#define CHANNEL_MAX 256
+
+struct channel
+{
+    int id;
+    /**
+     * Port the channel listens on, 0 for a single channel on a service
+     * name rather than a port number
+     */
+    int port;
+    /**
+     * Data file or device node, the base path for channel 0 and the base
+     * path followed by the channel number for the others
+     */
+    char *path;
+    /**
+     * In memory copy of the data file, appended to by its writer thread
+     */
+    struct datalog log;
+    /**
+     * The last timestamp queued for the log still has to be waited for
+     */
+    bool stamp_pending;
+    uint64_t stamp_seq;
+};
+
+extern struct channel *channels;
+extern int nr_channels;
+
+/**
+ * Sets up @param n channels storing to @param path and listening from
+ * @param port on, which has to be a port number for more than one channel.
+ * @return 0 on success, -1 on error.
+ */
+extern int channels_init(int n, const char *path, const char *port);
+
+/**
+ * @return the channel the connection @param fd was accepted for, from the
+ * port it was accepted on, or NULL if no channel listens there.
+ */
+extern struct channel *channel_of(int fd);
+
+#endif /* AESDSOCKET_CHANNEL_H */
@@ -0,0 +1,92 @@
+/**
+ * @file command.c
+ * @brief Dispatch table and parser of the control commands
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "command.h"
+#include "logger.h"
+
+/*
+ * AESDCHAR_IOCSEEKTO:write_cmd,write_cmd_offset moves the file position to
+ * the given offset of the given write, where the echo then starts.
+ */
+static off_t run_seekto(int fd, const uint32_t *args)
+{
+    struct aesd_seekto seekto = {
+        .write_cmd = args[0],
+        .write_cmd_offset = args[1],
+    };
+    int result = ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto);
+
+    logger_log(LOG_DEBUG, "Send AESDCHAR_IOCSEEKTO with cmd: %u offset: %u, result: %d",
+               seekto.write_cmd, seekto.write_cmd_offset, result);
+    if(result != 0){
+        return -1;
+    }
+    // the ioctl only moves this open file's position
+    return lseek(fd, 0, SEEK_CUR);
+}
+
+#define COMMAND(name, args, handler) { name, sizeof(name) - 1, args, handler }
+
+static const struct command commands[] = {
+    COMMAND("AESDCHAR_IOCSEEKTO", 2, run_seekto),
+};
+
+/*
+ * Parses the unsigned decimal at @param p, up to @param end.
+ * @return a pointer past its last digit, or NULL if there is none or it
+ * overflows.
+ */
+static const char *parse_u32(const char *p, const char *end, uint32_t *value)
+{
+    uint64_t n = 0;
+    const char *start = p;
+
+    while (p < end && *p >= '0' && *p <= '9'){
+        n = n * 10 + (*p - '0');
+        if(n > UINT32_MAX){
+            return NULL;
+        }
+        p++;
+    }
+    *value = n;
+    return p == start ? NULL : p;
+}
+
+int command_parse(const char *packet, size_t len, const struct command **cmd,
+                  uint32_t args[COMMAND_MAX_ARGS])
+{
+    const char *end = packet + len;
+
+    // only the newline terminating the packet may follow the arguments
+    if(len > 0 && end[-1] == '\n'){
+        end--;
+    }
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++){
+        const struct command *c = &commands[i];
+        const char *p = packet + c->verb_len;
+
+        if(len <= c->verb_len || memcmp(packet, c->verb, c->verb_len) != 0 || *p != ':'){
+            continue;
+        }
+        for (int arg = 0; arg < c->nr_args; arg++){
+            if(p == end || *p != (arg == 0 ? ':' : ',')){
+                return -1;
+            }
+            p = parse_u32(p + 1, end, &args[arg]);
+            if(p == NULL){
+                return -1;
+            }
+        }
+        if(p != end){
+            return -1;
+        }
+        *cmd = c;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * command.h
+ *
+ *  @brief Control commands sent in place of data packets.  A packet starting
+ *  with a verb from the dispatch table, followed by ':' and the verb's comma
+ *  separated decimal arguments, runs the verb's handler instead of being
+ *  stored.  Parsing is a single pass over the packet without copies or
+ *  hidden state, so any number of connection threads may parse at once.
+ */
+
+#ifndef AESDSOCKET_COMMAND_H
+#define AESDSOCKET_COMMAND_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define COMMAND_MAX_ARGS 4
+
+struct command
+{
+    const char *verb;
+    size_t verb_len;
+    int nr_args;
+    /**
+     * Runs the command on the backing device open as @param fd with its
+     * parsed @param args.
+     * @return the offset the echo starts from, or -1 on error.
+     */
+    off_t (*run)(int fd, const uint32_t *args);
+};
+
+/**
+ * Parses @param packet of @param len bytes, newline included.  For a
+ * command, points @param cmd to its table entry and fills @param args.
+ * @return 1 for a command, 0 for a data packet, -1 for a packet starting
+ * with a verb but with malformed arguments.
+ */
+extern int command_parse(const char *packet, size_t len, const struct command **cmd,
+                         uint32_t args[COMMAND_MAX_ARGS]);
+
+#endif /* AESDSOCKET_COMMAND_H */
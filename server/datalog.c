@@ -0,0 +1,426 @@
+/**
+ * @file datalog.c
+ * @brief Segmented in memory append log written through to the data file
+ *
+ * Appends follow the bounded ring of Vyukov's MPMC queue: a producer takes
+ * a sequence number, waits for its slot to be free and marks it filled.
+ * The writer thread is the only consumer, so it consumes slots strictly in
+ * sequence order, which keeps appends in the order their sequence numbers
+ * were handed out.  Producers sleep on a futex until the writer published
+ * their append.
+ *
+ * Trimmed segments are reclaimed with a reference count on the segment a
+ * snapshot starts from.  A snapshot reads forwards from it, so the writer
+ * frees trimmed segments front to back and stops at the first one pinned.
+ * A reader may still be about to pin the head it loaded before the writer
+ * moved it, so nothing is freed while a reader is between the two.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "datalog.h"
+#include "logger.h"
+
+/*
+ * Links enough empty segments after the tail to hold @param len more bytes,
+ * so a failed allocation leaves the log untouched.  Called by the writer
+ * thread only.
+ */
+static int datalog_reserve(struct datalog *log, size_t len)
+{
+    struct datalog_seg *last = log->tail;
+    size_t space = DATALOG_SEG_SIZE - log->tail_used;
+
+    while (space < len){
+        if(last->next == NULL){
+            struct datalog_seg *seg = malloc(sizeof(*seg));
+            if(seg == NULL){
+                return -1;
+            }
+            seg->next = NULL;
+            seg->base = last->base + DATALOG_SEG_SIZE;
+            atomic_init(&seg->refs, 0);
+            last->next = seg;
+        }
+        last = last->next;
+        space += DATALOG_SEG_SIZE;
+    }
+    return 0;
+}
+
+/*
+ * Copies @param len bytes into segments reserved by datalog_reserve.  The
+ * bytes are not yet published.
+ */
+static void datalog_store(struct datalog *log, const char *data, size_t len)
+{
+    while (len > 0){
+        if(log->tail_used == DATALOG_SEG_SIZE){
+            log->tail = log->tail->next;
+            log->tail_used = 0;
+        }
+        size_t n = DATALOG_SEG_SIZE - log->tail_used;
+        if(n > len){
+            n = len;
+        }
+        memcpy(log->tail->data + log->tail_used, data, n);
+        log->tail_used += n;
+        data += n;
+        len -= n;
+    }
+}
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr, int nr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nr, NULL, NULL, 0);
+}
+
+/*
+ * Writes all of @param iov to the backing file, retrying short writes.
+ * @return 0 on success, -1 on error.
+ */
+static int datalog_write_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0){
+        ssize_t written = writev(fd, iov, iovcnt);
+        if(written < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            // the in memory copy stays authoritative
+            perror("writev");
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t) written >= iov->iov_len){
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0){
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+static size_t datalog_count_lines(const char *data, size_t len)
+{
+    const char *end = data + len;
+    size_t lines = 0;
+
+    while ((data = memchr(data, '\n', end - data)) != NULL){
+        data++;
+        lines++;
+    }
+    return lines;
+}
+
+/*
+ * Trims the oldest lines off the window until it fits the limits, keeping
+ * at least the last line.  Called by the writer thread only.
+ */
+static void datalog_trim(struct datalog *log)
+{
+    struct datalog_seg *seg = atomic_load_explicit(&log->head, memory_order_relaxed);
+    size_t begin = atomic_load_explicit(&log->begin, memory_order_relaxed);
+    size_t end = atomic_load_explicit(&log->end, memory_order_relaxed);
+    size_t off = begin - seg->base;
+
+    if(log->max_lines == 0 && log->max_bytes == 0){
+        return;
+    }
+    while (log->lines > 1 && ((log->max_lines > 0 && log->lines > log->max_lines) ||
+                              (log->max_bytes > 0 && end - begin > log->max_bytes))){
+        // more than one newline is left, so one ends the first line
+        while (1){
+            if(off == DATALOG_SEG_SIZE){
+                seg = seg->next;
+                off = 0;
+            }
+            size_t n = DATALOG_SEG_SIZE - off;
+            if(n > end - begin){
+                n = end - begin;
+            }
+            const char *nl = memchr(seg->data + off, '\n', n);
+            if(nl != NULL){
+                off = nl - seg->data + 1;
+                begin = seg->base + off;
+                break;
+            }
+            off += n;
+            begin += n;
+        }
+        log->lines--;
+    }
+    if(off == DATALOG_SEG_SIZE){
+        seg = seg->next;
+    }
+    atomic_store_explicit(&log->begin, begin, memory_order_release);
+    // seq_cst against readers pinning, see datalog_reclaim
+    atomic_store(&log->head, seg);
+}
+
+/*
+ * Frees trimmed segments no snapshot reads from anymore.  Called by the
+ * writer thread only.
+ */
+static void datalog_reclaim(struct datalog *log)
+{
+    struct datalog_seg *head = atomic_load_explicit(&log->head, memory_order_relaxed);
+
+    if(log->retired == head){
+        return;
+    }
+    // a reader that loaded a trimmed segment as head either raised its
+    // count by now, or is yet to and keeps us from freeing anything
+    if(atomic_load(&log->pinning) != 0){
+        return;
+    }
+    while (log->retired != head && atomic_load_explicit(&log->retired->refs, memory_order_acquire) == 0){
+        struct datalog_seg *seg = log->retired;
+        log->retired = seg->next;
+        free(seg);
+    }
+}
+
+/*
+ * Replaces the backing file with one holding just the window, once it holds
+ * at least as many trimmed bytes as retained ones, and at least a segment's
+ * worth, so every byte is rewritten a bounded number of times.  Called by
+ * the writer thread only.
+ */
+static void datalog_rotate(struct datalog *log)
+{
+    struct datalog_seg *seg = atomic_load_explicit(&log->head, memory_order_relaxed);
+    size_t begin = atomic_load_explicit(&log->begin, memory_order_relaxed);
+    size_t end = atomic_load_explicit(&log->end, memory_order_relaxed);
+    size_t off = begin - seg->base;
+    char tmp_path[PATH_MAX];
+    int fd;
+
+    if(begin - log->file_begin < DATALOG_SEG_SIZE || begin - log->file_begin < end - begin){
+        return;
+    }
+    if(snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", log->path) >= (int) sizeof(tmp_path)){
+        return;
+    }
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if(fd < 0){
+        perror("open");
+        return;
+    }
+    for (size_t left = end - begin; left > 0; seg = seg->next, off = 0){
+        struct iovec iov = { seg->data + off, DATALOG_SEG_SIZE - off };
+        if(iov.iov_len > left){
+            iov.iov_len = left;
+        }
+        left -= iov.iov_len;
+        if(datalog_write_all(fd, &iov, 1) < 0){
+            goto fail;
+        }
+    }
+    if(rename(tmp_path, log->path) < 0){
+        perror("rename");
+        goto fail;
+    }
+    close(log->fd);
+    log->fd = fd;
+    log->file_begin = begin;
+    logger_log(LOG_DEBUG, "Rotated %s to %zu bytes", log->path, end - begin);
+    return;
+
+fail:
+    close(fd);
+    unlink(tmp_path);
+}
+
+/*
+ * Sleeps until a producer fills the slot for append @param seq.
+ */
+static void datalog_writer_sleep(struct datalog *log, uint64_t seq)
+{
+    struct datalog_slot *slot = &log->ring[seq & (DATALOG_RING_SIZE - 1)];
+    uint32_t work = atomic_load(&log->work_futex);
+
+    atomic_store(&log->writer_sleeping, 1);
+    // either this check sees the slot filled or the producer sees us asleep
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&slot->seq, memory_order_acquire) != seq + 1){
+        futex_wait(&log->work_futex, work);
+    }
+    atomic_store(&log->writer_sleeping, 0);
+}
+
+static void *datalog_writer(void *arg)
+{
+    struct datalog *log = arg;
+    struct iovec iov[DATALOG_BATCH_MAX];
+    uint64_t seq = atomic_load(&log->published);
+    size_t len = atomic_load(&log->end);
+    bool bounded = log->max_lines > 0 || log->max_bytes > 0;
+
+    while (1){
+        int n = 0;
+        while (n < DATALOG_BATCH_MAX){
+            struct datalog_slot *slot = &log->ring[(seq + n) & (DATALOG_RING_SIZE - 1)];
+            if(atomic_load_explicit(&slot->seq, memory_order_acquire) != seq + n + 1){
+                break;
+            }
+            iov[n].iov_base = (void *) slot->data;
+            iov[n].iov_len = slot->len;
+            n++;
+        }
+        if(n == 0){
+            datalog_writer_sleep(log, seq);
+            continue;
+        }
+
+        for (int i = 0; i < n; i++){
+            if(datalog_reserve(log, iov[i].iov_len) < 0){
+                logger_log(LOG_ERR, "Out of memory, dropping %zu byte append", iov[i].iov_len);
+                iov[i].iov_len = 0;
+                continue;
+            }
+            datalog_store(log, iov[i].iov_base, iov[i].iov_len);
+            len += iov[i].iov_len;
+            if(bounded){
+                log->lines += datalog_count_lines(iov[i].iov_base, iov[i].iov_len);
+            }
+        }
+        datalog_write_all(log->fd, iov, n);
+        atomic_store_explicit(&log->end, len, memory_order_release);
+        if(bounded){
+            datalog_trim(log);
+            datalog_rotate(log);
+            datalog_reclaim(log);
+        }
+
+        // hand the slots to the appends one lap ahead
+        for (int i = 0; i < n; i++){
+            struct datalog_slot *slot = &log->ring[(seq + i) & (DATALOG_RING_SIZE - 1)];
+            atomic_store_explicit(&slot->seq, seq + i + DATALOG_RING_SIZE, memory_order_release);
+        }
+        seq += n;
+
+        atomic_store(&log->published, seq);
+        atomic_fetch_add(&log->published_futex, 1);
+        if(atomic_load(&log->published_waiters) > 0){
+            futex_wake(&log->published_futex, INT_MAX);
+        }
+    }
+    return NULL;
+}
+
+int datalog_open(struct datalog *log, const char *path, size_t max_lines, size_t max_bytes)
+{
+    memset(log, 0, sizeof(*log));
+    log->path = path;
+    log->max_lines = max_lines;
+    log->max_bytes = max_bytes;
+    for (uint64_t i = 0; i < DATALOG_RING_SIZE; i++){
+        atomic_init(&log->ring[i].seq, i);
+    }
+
+    log->head = malloc(sizeof(*log->head));
+    if(log->head == NULL){
+        return -1;
+    }
+    log->head->next = NULL;
+    log->head->base = 0;
+    atomic_init(&log->head->refs, 0);
+    log->tail = log->head;
+    log->retired = log->head;
+
+    log->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(log->fd < 0){
+        perror("open");
+        return -1;
+    }
+
+    // pick up whatever a previous run left behind
+    size_t len = 0;
+    while (1){
+        if(log->tail_used == DATALOG_SEG_SIZE){
+            if(datalog_reserve(log, DATALOG_SEG_SIZE) < 0){
+                return -1;
+            }
+            log->tail = log->tail->next;
+            log->tail_used = 0;
+        }
+        ssize_t nread = read(log->fd, log->tail->data + log->tail_used,
+                             DATALOG_SEG_SIZE - log->tail_used);
+        if(nread < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("read");
+            return -1;
+        }
+        if(nread == 0){
+            break;
+        }
+        log->lines += datalog_count_lines(log->tail->data + log->tail_used, nread);
+        log->tail_used += nread;
+        len += nread;
+    }
+    atomic_store_explicit(&log->end, len, memory_order_release);
+    // a previous run may have kept more, or been rotated less often
+    datalog_trim(log);
+    datalog_rotate(log);
+    datalog_reclaim(log);
+
+    if(pthread_create(&log->writer, NULL, datalog_writer, log) != 0){
+        perror("pthread_create");
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t datalog_submit(struct datalog *log, const char *data, size_t len)
+{
+    uint64_t seq = atomic_fetch_add(&log->next_seq, 1);
+    struct datalog_slot *slot = &log->ring[seq & (DATALOG_RING_SIZE - 1)];
+
+    // the ring is full until the writer consumed the append one lap behind
+    while (atomic_load_explicit(&slot->seq, memory_order_acquire) != seq){
+        datalog_wait(log, seq - DATALOG_RING_SIZE);
+    }
+    slot->data = data;
+    slot->len = len;
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+
+    // either the writer sees the slot filled or we see it asleep
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load(&log->writer_sleeping)){
+        atomic_fetch_add(&log->work_futex, 1);
+        futex_wake(&log->work_futex, 1);
+    }
+    return seq;
+}
+
+void datalog_wait(struct datalog *log, uint64_t seq)
+{
+    while (atomic_load_explicit(&log->published, memory_order_acquire) <= seq){
+        uint32_t published = atomic_load(&log->published_futex);
+        atomic_fetch_add(&log->published_waiters, 1);
+        if(atomic_load(&log->published) <= seq){
+            futex_wait(&log->published_futex, published);
+        }
+        atomic_fetch_sub(&log->published_waiters, 1);
+    }
+}
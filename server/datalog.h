@@ -0,0 +1,207 @@
+/*
+ * datalog.h
+ *
+ *  @brief In memory append only copy of the aesdsocket data file.  Producers
+ *  queue appends on a lock free multi producer ring.  A single writer thread
+ *  drains it in order, copies each batch into the log's segments and writes
+ *  the batch through to the backing file with one writev().  Readers take a
+ *  snapshot of the published window without locking and send straight from
+ *  the log's segments.
+ *
+ *  Retention can be bounded to the last lines or bytes appended.  The
+ *  writer trims whole lines off the front of the window, frees segments
+ *  once no snapshot still reads from them, and rotates the backing file
+ *  when it holds more trimmed bytes than retained ones.
+ */
+
+#ifndef AESDSOCKET_DATALOG_H
+#define AESDSOCKET_DATALOG_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DATALOG_SEG_SIZE 65536
+// pending appends, must be a power of two
+#define DATALOG_RING_SIZE 1024
+// appends the writer folds into a single writev()
+#define DATALOG_BATCH_MAX 64
+
+struct datalog_seg
+{
+    /**
+     * Following segment, set before any byte stored in it is published
+     */
+    struct datalog_seg *next;
+    /**
+     * Log offset of data[0]
+     */
+    size_t base;
+    /**
+     * Snapshots reading from this segment onwards
+     */
+    _Atomic unsigned refs;
+    char data[DATALOG_SEG_SIZE];
+};
+
+struct datalog_slot
+{
+    /**
+     * Equal to the sequence number of the append which may fill the slot
+     * next, one more than that once it was filled
+     */
+    _Atomic uint64_t seq;
+    const char *data;
+    size_t len;
+};
+
+struct datalog
+{
+    /**
+     * Segment holding the first retained byte.  Segments are never moved,
+     * and only freed once trimmed and no snapshot pins them
+     */
+    struct datalog_seg *_Atomic head;
+    /**
+     * Oldest trimmed segment not freed yet, head if there is none, only
+     * accessed by the writer thread
+     */
+    struct datalog_seg *retired;
+    /**
+     * Segment being appended to and the bytes stored in it, only accessed by
+     * the writer thread
+     */
+    struct datalog_seg *tail;
+    size_t tail_used;
+    /**
+     * Readers may access the bytes from begin up to end.  Offsets count
+     * every byte the log held since it was opened, begin always starts a
+     * line
+     */
+    _Atomic size_t begin;
+    _Atomic size_t end;
+    /**
+     * Readers between loading head and pinning it
+     */
+    _Atomic unsigned pinning;
+    /**
+     * Lines to keep and bytes to keep, 0 for no limit, and the number of
+     * newlines between begin and end, only accessed by the writer thread
+     */
+    size_t max_lines;
+    size_t max_bytes;
+    size_t lines;
+    /**
+     * Backing file every append is written through to, the path it is
+     * rotated at and the log offset of its first byte
+     */
+    int fd;
+    const char *path;
+    size_t file_begin;
+
+    struct datalog_slot ring[DATALOG_RING_SIZE];
+    /**
+     * Sequence number handed to the next append
+     */
+    _Atomic uint64_t next_seq;
+    /**
+     * Appends with a lower sequence number are visible to readers
+     */
+    _Atomic uint64_t published;
+    /**
+     * Futex words bumped when appends are published and when the sleeping
+     * writer has work, along with the number of threads waiting on them
+     */
+    _Atomic uint32_t published_futex;
+    _Atomic uint32_t published_waiters;
+    _Atomic uint32_t work_futex;
+    _Atomic uint32_t writer_sleeping;
+    pthread_t writer;
+};
+
+/**
+ * A consistent view of the log: len bytes starting at offset off of seg.
+ * The segment pinned keeps seg and the ones after it from being freed until
+ * the snapshot is released.
+ */
+struct datalog_snapshot
+{
+    const struct datalog_seg *seg;
+    size_t off;
+    size_t len;
+    struct datalog_seg *pinned;
+};
+
+/**
+ * Opens @param path as the backing file of @param log, loading anything it
+ * already holds, and starts the writer thread.  The log keeps at most the
+ * last @param max_lines lines and @param max_bytes bytes, 0 for no limit,
+ * but always the last line whatever its length.
+ * @return 0 on success, -1 on error.
+ */
+extern int datalog_open(struct datalog *log, const char *path, size_t max_lines, size_t max_bytes);
+
+/**
+ * Queues @param len bytes of @param data for appending.  @param data must
+ * stay valid until the append was published, see datalog_wait.
+ * @return the sequence number of the append.
+ */
+extern uint64_t datalog_submit(struct datalog *log, const char *data, size_t len);
+
+/**
+ * Waits until the append numbered @param seq, and every append before it,
+ * is visible to snapshots.
+ */
+extern void datalog_wait(struct datalog *log, uint64_t seq);
+
+/**
+ * Appends @param len bytes of @param data and waits until they are visible.
+ */
+static inline void datalog_append(struct datalog *log, const char *data, size_t len)
+{
+    datalog_wait(log, datalog_submit(log, data, len));
+}
+
+/**
+ * Takes a snapshot of the retained window of @param log into @param snap,
+ * to be released with datalog_release.
+ */
+static inline void datalog_snapshot(struct datalog *log, struct datalog_snapshot *snap)
+{
+    struct datalog_seg *seg;
+    size_t begin;
+
+    // the writer doesn't free trimmed segments while anyone is pinning, so
+    // the head loaded here stays valid until its count was raised
+    atomic_fetch_add(&log->pinning, 1);
+    seg = atomic_load(&log->head);
+    atomic_fetch_add_explicit(&seg->refs, 1, memory_order_relaxed);
+    atomic_fetch_sub(&log->pinning, 1);
+    snap->pinned = seg;
+
+    // pairs with the releases in the writer: begin never lies before the
+    // head it was published with, end never before begin, and every byte
+    // below end and the segment links leading to it are visible
+    begin = atomic_load_explicit(&log->begin, memory_order_acquire);
+    snap->len = atomic_load_explicit(&log->end, memory_order_acquire) - begin;
+    snap->off = begin - seg->base;
+    // the writer may have trimmed past the head since
+    while (snap->len > 0 && snap->off >= DATALOG_SEG_SIZE){
+        seg = seg->next;
+        snap->off -= DATALOG_SEG_SIZE;
+    }
+    snap->seg = seg;
+}
+
+/**
+ * Unpins the segments of a snapshot taken with datalog_snapshot, @param
+ * pinned being its pinned segment.
+ */
+static inline void datalog_release(struct datalog_seg *pinned)
+{
+    // pairs with the acquire in the writer, the snapshot is done reading
+    atomic_fetch_sub_explicit(&pinned->refs, 1, memory_order_release);
+}
+
+#endif /* AESDSOCKET_DATALOG_H */
@@ -0,0 +1,83 @@
+/**
+ * @file framebuf.c
+ * @brief Newline packet framing over a growable receive buffer
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "framebuf.h"
+
+void framebuf_init(struct framebuf *fb, size_t max_packet)
+{
+    memset(fb, 0, sizeof(*fb));
+    fb->max_packet = max_packet;
+}
+
+void framebuf_free(struct framebuf *fb)
+{
+    free(fb->data);
+    framebuf_init(fb, fb->max_packet);
+}
+
+char *framebuf_reserve(struct framebuf *fb, size_t min, size_t *avail)
+{
+    // drop packets already handed out, only a partial packet is ever moved
+    if(fb->start > 0){
+        size_t pending = fb->len - fb->start;
+        if(pending > 0){
+            memmove(fb->data, fb->data + fb->start, pending);
+        }
+        fb->scanned -= fb->start;
+        fb->len = pending;
+        fb->start = 0;
+    }
+
+    if(fb->cap - fb->len < min){
+        size_t cap = fb->cap ? fb->cap : FRAMEBUF_INITIAL_SIZE;
+        while (cap - fb->len < min){
+            cap *= 2;
+        }
+        char *data = realloc(fb->data, cap);
+        if(data == NULL){
+            return NULL;
+        }
+        fb->data = data;
+        fb->cap = cap;
+    }
+
+    *avail = fb->cap - fb->len;
+    return fb->data + fb->len;
+}
+
+void framebuf_commit(struct framebuf *fb, size_t n)
+{
+    fb->len += n;
+}
+
+const char *framebuf_next_packet(struct framebuf *fb, size_t *len)
+{
+    const char *packet = fb->data + fb->start;
+    char *newline = NULL;
+
+    if(fb->overflow){
+        return NULL;
+    }
+    if(fb->scanned < fb->len){
+        newline = memchr(fb->data + fb->scanned, '\n', fb->len - fb->scanned);
+    }
+    if(newline == NULL){
+        fb->scanned = fb->len;
+        // the partial packet alone is already too long
+        fb->overflow = fb->max_packet > 0 && fb->len - fb->start > fb->max_packet;
+        return NULL;
+    }
+
+    *len = newline - packet + 1;
+    if(fb->max_packet > 0 && *len > fb->max_packet){
+        fb->overflow = true;
+        return NULL;
+    }
+    fb->start += *len;
+    fb->scanned = fb->start;
+    return packet;
+}
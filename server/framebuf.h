@@ -0,0 +1,96 @@
+/*
+ * framebuf.h
+ *
+ *  @brief Growable receive buffer splitting a byte stream into newline
+ *  terminated packets.  Each received byte is scanned for a newline exactly
+ *  once, and complete packets are returned as pointers into the buffer
+ *  rather than copies.
+ */
+
+#ifndef AESDSOCKET_FRAMEBUF_H
+#define AESDSOCKET_FRAMEBUF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct framebuf
+{
+    /**
+     * Storage for received bytes, cap bytes long
+     */
+    char *data;
+    size_t cap;
+    /**
+     * Offset of the first byte not yet returned as part of a packet
+     */
+    size_t start;
+    /**
+     * Offset one past the last received byte
+     */
+    size_t len;
+    /**
+     * Offset up to which data has already been searched for a newline
+     */
+    size_t scanned;
+    /**
+     * Longest packet accepted, 0 for no limit, and whether a longer one
+     * was received.  Nothing more is framed once it was
+     */
+    size_t max_packet;
+    bool overflow;
+};
+
+#define FRAMEBUF_INITIAL_SIZE 1024
+
+/**
+ * Initializes @param fb to accept packets of up to @param max_packet bytes,
+ * 0 for no limit.
+ */
+extern void framebuf_init(struct framebuf *fb, size_t max_packet);
+
+extern void framebuf_free(struct framebuf *fb);
+
+/**
+ * Makes room for at least @param min more bytes at the end of the buffer,
+ * growing it geometrically and discarding bytes of packets already returned.
+ * Invalidates packet pointers previously returned by framebuf_next_packet.
+ * @param avail is set to the number of bytes which may be written.
+ * @return a pointer to write received bytes to, or NULL if out of memory.
+ */
+extern char *framebuf_reserve(struct framebuf *fb, size_t min, size_t *avail);
+
+/**
+ * Marks @param n bytes written at the pointer returned by framebuf_reserve as
+ * received.
+ */
+extern void framebuf_commit(struct framebuf *fb, size_t n);
+
+/**
+ * Returns the next complete packet, including its trailing newline, and
+ * stores its length in @param len.  The packet is not NUL terminated and stays
+ * valid until the next call to framebuf_reserve.  Sets overflow when the
+ * packet, or the part of it received so far, exceeds max_packet.
+ * @return a pointer to the packet, or NULL if no complete packet is buffered
+ * or on overflow.
+ */
+extern const char *framebuf_next_packet(struct framebuf *fb, size_t *len);
+
+/**
+ * Puts back the packet of @param len bytes framebuf_next_packet just
+ * returned, so the next call returns it again.
+ */
+static inline void framebuf_unread(struct framebuf *fb, size_t len)
+{
+    fb->start -= len;
+    fb->scanned = fb->start;
+}
+
+/**
+ * @return the number of bytes buffered for the packet still being received.
+ */
+static inline size_t framebuf_pending(const struct framebuf *fb)
+{
+    return fb->len - fb->start;
+}
+
+#endif /* AESDSOCKET_FRAMEBUF_H */
@@ -0,0 +1,177 @@
+/**
+ * @file logger.c
+ * @brief Per thread log rings drained by a background thread
+ *
+ * A thread's ring is allocated the first time it logs and pushed onto a
+ * lock free list, never to be unlinked, like the metric shards.  Each ring
+ * has a single producer, its thread, and a single consumer at a time,
+ * whoever holds flush_lock: the logger thread, or the thread exiting the
+ * process.  Records are stamped with the monotonic clock and the rings
+ * merged by it, so messages from different threads come out in order.
+ * Without the logger thread every record is flushed as soon as it is
+ * written instead.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "logger.h"
+
+struct logger_record {
+    uint64_t ns;
+    int level;
+    unsigned short len;
+    char text[LOGGER_RECORD_SIZE];
+};
+
+struct logger_ring {
+    // next record to drain, written by the consumer
+    unsigned head;
+    // next record to fill, written by the producer
+    unsigned tail;
+    // tail as of the flush in progress
+    unsigned flush_tail;
+    // records lost to a full ring, and how many of those were reported
+    unsigned long dropped;
+    unsigned long reported;
+    struct logger_ring *next;
+    struct logger_record records[LOGGER_RING_SIZE];
+};
+
+int logger_level = LOG_INFO;
+
+static __thread struct logger_ring *logger_local;
+static struct logger_ring *rings;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+// the logger thread couldn't be started, writers flush their own records
+static bool synchronous;
+
+static void flush(void);
+
+static struct logger_ring *ring_new(void)
+{
+    struct logger_ring *ring = calloc(1, sizeof(*ring));
+    if(ring == NULL){
+        return NULL;
+    }
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+    }
+    logger_local = ring;
+    return ring;
+}
+
+void logger_write(int level, const char *fmt, ...)
+{
+    struct logger_ring *ring = logger_local ? logger_local : ring_new();
+    struct logger_record *record;
+    unsigned tail;
+    struct timespec now;
+    va_list ap;
+    int len;
+
+    if(ring == NULL){
+        return;
+    }
+    tail = ring->tail;
+    if(tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LOGGER_RING_SIZE){
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    record = &ring->records[tail & (LOGGER_RING_SIZE - 1)];
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    record->ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    va_start(ap, fmt);
+    len = vsnprintf(record->text, sizeof(record->text), fmt, ap);
+    va_end(ap);
+    record->level = level;
+    record->len = len < 0 ? 0 : len < (int) sizeof(record->text) ? (unsigned short) len :
+                                                                  (unsigned short) (sizeof(record->text) - 1);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    if(__atomic_load_n(&synchronous, __ATOMIC_RELAXED)){
+        flush();
+    }
+}
+
+static void write_record(const struct logger_record *record)
+{
+    fwrite(record->text, 1, record->len, stdout);
+    putchar('\n');
+    if(record->level <= LOG_INFO){
+        syslog(record->level, "%s", record->text);
+    }
+}
+
+/*
+ * Writes out every record published so far, oldest first across all rings.
+ */
+static void flush(void)
+{
+    struct logger_ring *ring;
+
+    pthread_mutex_lock(&flush_lock);
+    // only drain up to the tails seen now, records published meanwhile
+    // wait for the next flush
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next){
+        ring->flush_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    }
+    while (1){
+        struct logger_ring *oldest = NULL;
+        for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next){
+            if(ring->head != ring->flush_tail &&
+               (oldest == NULL || ring->records[ring->head & (LOGGER_RING_SIZE - 1)].ns <
+                                  oldest->records[oldest->head & (LOGGER_RING_SIZE - 1)].ns)){
+                oldest = ring;
+            }
+        }
+        if(oldest == NULL){
+            break;
+        }
+        write_record(&oldest->records[oldest->head & (LOGGER_RING_SIZE - 1)]);
+        __atomic_store_n(&oldest->head, oldest->head + 1, __ATOMIC_RELEASE);
+    }
+
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next){
+        unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if(dropped != ring->reported){
+            printf("%lu log messages dropped\n", dropped - ring->reported);
+            ring->reported = dropped;
+        }
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&flush_lock);
+}
+
+static void *logger_run(void *arg __attribute__((unused)))
+{
+    struct timespec interval = { .tv_nsec = LOGGER_FLUSH_MS * 1000000L };
+
+    while (1){
+        flush();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+bool logger_start(void)
+{
+    pthread_t tid;
+    int rc;
+
+    atexit(flush);
+    rc = pthread_create(&tid, NULL, logger_run, NULL);
+    if(rc != 0){
+        fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+        // write what was buffered so far, and every record from now on
+        __atomic_store_n(&synchronous, true, __ATOMIC_RELAXED);
+        flush();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,72 @@
+/*
+ * logger.h
+ *
+ *  @brief Asynchronous logging for aesdsocket.  Each thread formats its
+ *  records into a ring of its own, without locks or system calls.  A
+ *  background thread drains the rings to stdout, and forwards records at
+ *  LOG_INFO or more severe to syslog, so connection handlers never wait on
+ *  the console or the syslog socket.  Records are dropped, and the drops
+ *  reported, when a thread logs faster than the rings are drained.
+ */
+
+#ifndef AESDSOCKET_LOGGER_H
+#define AESDSOCKET_LOGGER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <syslog.h>
+
+// records buffered per thread, must be a power of two
+#define LOGGER_RING_SIZE 256
+// longer records are truncated
+#define LOGGER_RECORD_SIZE 240
+// bytes of a packet shown by debug dumps
+#define LOGGER_DUMP_MAX 64
+#define LOGGER_FLUSH_MS 20
+
+/**
+ * Least severe level compiled in, build with -DLOGGER_LEVEL_MAX=LOG_INFO to
+ * compile the packet dumps out
+ */
+#ifndef LOGGER_LEVEL_MAX
+#define LOGGER_LEVEL_MAX LOG_DEBUG
+#endif
+
+/**
+ * Least severe level logged at runtime, LOG_INFO unless verbose
+ */
+extern int logger_level;
+
+/**
+ * Logs a printf style message at the syslog @param level, skipping the
+ * formatting entirely when the level is filtered out.
+ */
+#define logger_log(level, ...) do { \
+        if((level) <= LOGGER_LEVEL_MAX && (level) <= logger_level) { \
+            logger_write((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+extern void logger_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * @return the length of a "%.*s" dump of the newline terminated packet of
+ * @param len bytes, without the newline and at most LOGGER_DUMP_MAX.
+ */
+static inline int logger_dump_len(size_t len)
+{
+    if(len > 0){
+        len--;
+    }
+    return len < LOGGER_DUMP_MAX ? (int) len : LOGGER_DUMP_MAX;
+}
+
+/**
+ * Starts the thread draining the rings.  Records logged before are kept
+ * and written once it runs.  Whatever is buffered at exit is flushed.
+ * @return true if the thread was started, otherwise records are written
+ * synchronously by the threads logging them.
+ */
+extern bool logger_start(void);
+
+#endif /* AESDSOCKET_LOGGER_H */
@@ -0,0 +1,113 @@
+/**
+ * @file metrics.c
+ * @brief Per thread metric shards and their Prometheus text rendering
+ *
+ * A thread's shard is allocated the first time it records and pushed onto
+ * a lock free list.  Threads live as long as the server, so shards are
+ * never unlinked and a scrape can walk the list without locking.  Loads
+ * racing the owner's stores may miss the latest samples but never see
+ * torn values.
+ */
+
+#include <stdlib.h>
+#include "metrics.h"
+
+__thread struct metrics_shard *metrics_local;
+static struct metrics_shard *shards;
+
+struct metric_info {
+    const char *name;
+    const char *help;
+};
+
+static const struct metric_info counter_info[METRICS_NR_COUNTERS] = {
+    [METRICS_ACCEPTED] = { "aesdsocket_connections_accepted_total", "Connections accepted" },
+    [METRICS_REJECTED] = { "aesdsocket_connections_rejected_total", "Connections reset over the connection limit" },
+    [METRICS_PACKETS] = { "aesdsocket_packets_total", "Packets stored" },
+    [METRICS_BYTES_IN] = { "aesdsocket_received_bytes_total", "Bytes received from clients" },
+    [METRICS_BYTES_OUT] = { "aesdsocket_sent_bytes_total", "Bytes sent to clients" },
+};
+
+static const struct metric_info histogram_info[METRICS_NR_HISTOGRAMS] = {
+    [METRICS_FIRST_BYTE] = { "aesdsocket_first_byte_seconds", "Time from accept to the first byte received" },
+    [METRICS_PACKET] = { "aesdsocket_packet_seconds", "Time from receiving a packet to having sent its echo" },
+    [METRICS_APPEND] = { "aesdsocket_append_seconds", "Time spent storing a packet" },
+    [METRICS_ADMISSION_WAIT] = { "aesdsocket_admission_wait_seconds", "Time spent waiting for a connection slot" },
+};
+
+struct metrics_shard *metrics_shard_new(void)
+{
+    struct metrics_shard *shard = calloc(1, sizeof(*shard));
+    if(shard == NULL){
+        return NULL;
+    }
+    shard->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&shards, &shard->next, shard, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+    }
+    metrics_local = shard;
+    return shard;
+}
+
+/*
+ * @return the largest value, in nanoseconds, counted in @param bucket.
+ */
+static uint64_t bucket_upper(unsigned bucket)
+{
+    if(bucket < METRICS_SUB_COUNT){
+        return bucket;
+    }
+    unsigned shift = bucket / METRICS_SUB_COUNT - 1;
+    return ((uint64_t) (METRICS_SUB_COUNT + bucket % METRICS_SUB_COUNT + 1) << shift) - 1;
+}
+
+static void write_histogram(FILE *out, enum metrics_histogram histogram)
+{
+    const char *name = histogram_info[histogram].name;
+    uint64_t sum = 0;
+    uint64_t count = 0;
+    struct metrics_shard *shard;
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, histogram_info[histogram].help, name);
+    for (unsigned i = 0; i < METRICS_BUCKETS; i++){
+        uint64_t n = 0;
+        for (shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next){
+            n += __atomic_load_n(&shard->histograms[histogram].buckets[i], __ATOMIC_RELAXED);
+        }
+        count += n;
+        // buckets are cumulative, the same set of them is printed by every
+        // scrape, the last one of each power of two, so rate() and
+        // histogram_quantile() see no series come and go
+        if(i % METRICS_SUB_COUNT != METRICS_SUB_COUNT - 1){
+            continue;
+        }
+        fprintf(out, "%s_bucket{le=\"%.9f\"} %llu\n", name, bucket_upper(i) / 1e9,
+                (unsigned long long) count);
+    }
+    for (shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next){
+        sum += __atomic_load_n(&shard->histograms[histogram].sum, __ATOMIC_RELAXED);
+    }
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long) count);
+    fprintf(out, "%s_sum %.9f\n", name, sum / 1e9);
+    fprintf(out, "%s_count %llu\n", name, (unsigned long long) count);
+}
+
+void metrics_write(FILE *out, int active_conns)
+{
+    for (int c = 0; c < METRICS_NR_COUNTERS; c++){
+        uint64_t total = 0;
+        for (struct metrics_shard *shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+             shard != NULL; shard = shard->next){
+            total += __atomic_load_n(&shard->counters[c], __ATOMIC_RELAXED);
+        }
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter_info[c].name,
+                counter_info[c].help, counter_info[c].name, counter_info[c].name,
+                (unsigned long long) total);
+    }
+    fprintf(out, "# HELP aesdsocket_active_connections Connections being served\n"
+                 "# TYPE aesdsocket_active_connections gauge\n"
+                 "aesdsocket_active_connections %d\n", active_conns);
+    for (int h = 0; h < METRICS_NR_HISTOGRAMS; h++){
+        write_histogram(out, h);
+    }
+}
@@ -0,0 +1,131 @@
+/*
+ * metrics.h
+ *
+ *  @brief Counters and latency histograms for aesdsocket.  Every thread
+ *  records into a shard of its own, so recording is a plain load and store
+ *  without locks or atomic read-modify-write.  A scrape sums the shards.
+ *  Histograms use log-linear buckets, METRICS_SUB_COUNT per power of two,
+ *  bounding the relative error of any quantile to about 12%.  Scrapes
+ *  expose a fixed set of them, one per power of two.
+ */
+
+#ifndef AESDSOCKET_METRICS_H
+#define AESDSOCKET_METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+enum metrics_counter {
+    METRICS_ACCEPTED,
+    METRICS_REJECTED,
+    METRICS_PACKETS,
+    METRICS_BYTES_IN,
+    METRICS_BYTES_OUT,
+    METRICS_NR_COUNTERS,
+};
+
+enum metrics_histogram {
+    // from accept to the first byte received
+    METRICS_FIRST_BYTE,
+    // from receiving a packet to having sent its whole echo
+    METRICS_PACKET,
+    // storing a packet in the data log or the device
+    METRICS_APPEND,
+    // waiting for a connection slot under the connection limit
+    METRICS_ADMISSION_WAIT,
+    METRICS_NR_HISTOGRAMS,
+};
+
+#define METRICS_SUB_BITS 3
+#define METRICS_SUB_COUNT (1 << METRICS_SUB_BITS)
+// nanoseconds from 2^METRICS_MAX_BITS (about 18 minutes) share the last bucket
+#define METRICS_MAX_BITS 40
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) * METRICS_SUB_COUNT)
+
+struct metrics_shard
+{
+    uint64_t counters[METRICS_NR_COUNTERS];
+    struct {
+        uint64_t buckets[METRICS_BUCKETS];
+        uint64_t sum;
+    } histograms[METRICS_NR_HISTOGRAMS];
+    /**
+     * Shards are never freed, a scrape walks them through this link
+     */
+    struct metrics_shard *next;
+};
+
+extern __thread struct metrics_shard *metrics_local;
+
+/**
+ * @return the calling thread's shard, allocating it on first use, or NULL
+ * if out of memory.
+ */
+extern struct metrics_shard *metrics_shard_new(void);
+
+/**
+ * Writes every metric in the Prometheus text format to @param out.
+ * @param active_conns is reported as the open connections gauge.
+ */
+extern void metrics_write(FILE *out, int active_conns);
+
+/**
+ * @return CLOCK_MONOTONIC in nanoseconds, the time base of every histogram.
+ */
+static inline uint64_t metrics_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline unsigned metrics_bucket(uint64_t value)
+{
+    if(value < METRICS_SUB_COUNT){
+        return value;
+    }
+    unsigned msb = 63 - __builtin_clzll(value);
+    if(msb >= METRICS_MAX_BITS){
+        return METRICS_BUCKETS - 1;
+    }
+    unsigned shift = msb - METRICS_SUB_BITS;
+    return (shift + 1) * METRICS_SUB_COUNT + ((value >> shift) & (METRICS_SUB_COUNT - 1));
+}
+
+// only the owning thread writes a shard, scrapes merely load
+static inline void metrics_store_add(uint64_t *word, uint64_t value)
+{
+    __atomic_store_n(word, __atomic_load_n(word, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_add(enum metrics_counter counter, uint64_t value)
+{
+    struct metrics_shard *shard = metrics_local ? metrics_local : metrics_shard_new();
+    if(shard != NULL){
+        metrics_store_add(&shard->counters[counter], value);
+    }
+}
+
+/**
+ * Records a sample of @param ns nanoseconds in @param histogram.
+ */
+static inline void metrics_record(enum metrics_histogram histogram, uint64_t ns)
+{
+    struct metrics_shard *shard = metrics_local ? metrics_local : metrics_shard_new();
+    if(shard != NULL){
+        metrics_store_add(&shard->histograms[histogram].buckets[metrics_bucket(ns)], 1);
+        metrics_store_add(&shard->histograms[histogram].sum, ns);
+    }
+}
+
+/**
+ * Records the time elapsed since @param start, a metrics_now() value.
+ */
+static inline void metrics_record_since(enum metrics_histogram histogram, uint64_t start)
+{
+    metrics_record(histogram, metrics_now() - start);
+}
+
+#endif /* AESDSOCKET_METRICS_H */
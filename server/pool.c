@@ -0,0 +1,42 @@
+/**
+ * @file pool.c
+ * @brief Free list backed object pool
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+void *pool_alloc(struct pool *pool)
+{
+    void *obj;
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->free_list == NULL){
+        char *chunk = malloc(pool->obj_size * POOL_CHUNK_OBJS);
+        if(chunk == NULL){
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        // chunks are never released, thread every object onto the free list
+        for (int i = 0; i < POOL_CHUNK_OBJS; i++){
+            void *next = chunk + i * pool->obj_size;
+            *(void **) next = pool->free_list;
+            pool->free_list = next;
+        }
+    }
+    obj = pool->free_list;
+    pool->free_list = *(void **) obj;
+    pthread_mutex_unlock(&pool->lock);
+
+    memset(obj, 0, pool->obj_size);
+    return obj;
+}
+
+void pool_free(struct pool *pool, void *obj)
+{
+    pthread_mutex_lock(&pool->lock);
+    *(void **) obj = pool->free_list;
+    pool->free_list = obj;
+    pthread_mutex_unlock(&pool->lock);
+}
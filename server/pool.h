@@ -0,0 +1,46 @@
+/*
+ * pool.h
+ *
+ *  @brief Fixed size object pool for connection records.  Objects are carved
+ *  out of chunks allocated on demand and recycled through a free list
+ *  instead of going back to malloc, so accepting a connection doesn't hit
+ *  the allocator once the pool has warmed up.
+ */
+
+#ifndef AESDSOCKET_POOL_H
+#define AESDSOCKET_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// objects allocated at once when the free list runs dry
+#define POOL_CHUNK_OBJS 64
+
+struct pool
+{
+    size_t obj_size;
+    /**
+     * Recycled objects, linked through their first bytes
+     */
+    void *free_list;
+    /**
+     * Objects may be freed on a different thread than they were allocated
+     */
+    pthread_mutex_t lock;
+};
+
+#define POOL_INITIALIZER(type) \
+    { .obj_size = sizeof(type) < sizeof(void *) ? sizeof(void *) : sizeof(type), \
+      .free_list = NULL, .lock = PTHREAD_MUTEX_INITIALIZER }
+
+/**
+ * @return a zeroed object from @param pool, or NULL if out of memory.
+ */
+extern void *pool_alloc(struct pool *pool);
+
+/**
+ * Returns @param obj to @param pool.
+ */
+extern void pool_free(struct pool *pool, void *obj);
+
+#endif /* AESDSOCKET_POOL_H */
@@ -0,0 +1,44 @@
+/*
+ * ratelimit.h
+ *
+ *  @brief Token bucket limiting the packets a connection gets processed per
+ *  second.  The bucket holds up to a second's worth of tokens.  It is kept
+ *  as the time it will be full again, as in the generic cell rate
+ *  algorithm, so taking a token is a comparison and an addition without any
+ *  refill timer.
+ */
+
+#ifndef AESDSOCKET_RATELIMIT_H
+#define AESDSOCKET_RATELIMIT_H
+
+#include <stdint.h>
+
+struct ratelimit
+{
+    /**
+     * CLOCK_MONOTONIC nanoseconds by which every token taken so far would
+     * have been refilled
+     */
+    uint64_t refilled;
+};
+
+/**
+ * Takes a token from @param rl at @param now, a metrics_now() time, for a
+ * limit of @param rate tokens per second.
+ * @return 0 if a token was taken, otherwise the nanoseconds until the next
+ * one is available.
+ */
+static inline uint64_t ratelimit_take(struct ratelimit *rl, unsigned rate, uint64_t now)
+{
+    uint64_t interval = 1000000000 / rate;
+    uint64_t refilled = rl->refilled > now ? rl->refilled : now;
+
+    // the bucket is empty once a second's worth of tokens is outstanding
+    if(refilled + interval > now + 1000000000){
+        return refilled + interval - now - 1000000000;
+    }
+    rl->refilled = refilled + interval;
+    return 0;
+}
+
+#endif /* AESDSOCKET_RATELIMIT_H */
@@ -0,0 +1,521 @@
+/**
+ * @file reactor.c
+ * @brief Edge triggered epoll event loops serving aesdsocket connections
+ *
+ * Each event loop thread owns an epoll instance.  The accept loop in main()
+ * hands accepted connections to the loops round robin.  A connection reads
+ * until a recv completes a newline terminated packet, stores the packets
+ * through process_packet() and then streams the responses back from the
+ * backing store, continuing on EPOLLOUT when the socket buffer fills.  Once the responses are fully
+ * sent the connection is closed, the same packet semantics as the thread per
+ * connection handler.
+ *
+ * In session mode the connection instead keeps reading after each packet.
+ * Responses are queued behind each other so pipelined packets are answered in
+ * order, and connections without activity for SESSION_IDLE_TIMEOUT seconds
+ * are closed.  Each loop keeps its connections on a list ordered by last
+ * activity, so expiring them only looks at the head of the list.
+ *
+ * A connection stops reading while its packets have to wait, for the rate
+ * limit or behind CONN_MAX_QUEUED unsent responses, so the client is held
+ * back by its own socket buffer filling up.  Rate limited connections wait
+ * on a list of their loop, which wakes up for the earliest of them.  Ones
+ * whose echo made no progress for SEND_TIMEOUT seconds are closed along
+ * with the idle sessions.
+ *
+ * Draining wakes every loop through an eventfd.  Sessions then answer what
+ * they already received and close, single packet connections finish as
+ * usual.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "aesdsocket.h"
+#include "channel.h"
+#include "framebuf.h"
+#include "logger.h"
+#include "metrics.h"
+#include "pool.h"
+#include "queue.h"
+#include "ratelimit.h"
+#include "reactor.h"
+#include "response.h"
+
+#define REACTOR_MAX_EVENTS 64
+#define REACTOR_RECV_SIZE 1024
+
+struct conn {
+    int fd;
+    char peer[INET6_ADDRSTRLEN];
+    struct channel *channel;
+    struct framebuf fb;
+    // responses being sent back, in packet order, and their number
+    struct response_queue out;
+    int queued;
+    // TCP_CORK is held while responses are queued
+    bool corked;
+    // no more packets are read, close once the responses are sent
+    bool closing;
+    // framed packets wait for the rate limit or for responses to be sent
+    bool paused;
+    // linked on the owning loop's activity list once the loop has seen it
+    bool tracked;
+    time_t last_active;
+    // metrics_now() time of the accept, 0 once the first byte arrived
+    uint64_t accepted;
+    // metrics_now() time of the last recv
+    uint64_t received;
+    struct ratelimit rl;
+    // on the loop's throttled list until resume_at, a metrics_now() time
+    bool throttled;
+    uint64_t resume_at;
+    TAILQ_ENTRY(conn) entries;
+    TAILQ_ENTRY(conn) throttled_entries;
+};
+
+struct event_loop {
+    int epfd;
+    pthread_t thread;
+    // timer served by this loop, its events carry the loop itself
+    int timer_fd;
+    reactor_timer_handler_t timer_handler;
+    // connections ordered from least to most recently active
+    TAILQ_HEAD(, conn) conns;
+    // connections waiting for the rate limit
+    TAILQ_HEAD(, conn) throttled;
+    bool draining;
+};
+
+static struct event_loop *loops;
+static int nr_loops;
+static unsigned int next_loop;
+// readable once the loops should drain, its events carry its address
+static int drain_fd = -1;
+static struct pool conn_pool = POOL_INITIALIZER(struct conn);
+
+static time_t now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void conn_close(struct event_loop *loop, struct conn *conn)
+{
+    if(conn->tracked){
+        TAILQ_REMOVE(&loop->conns, conn, entries);
+    }
+    if(conn->throttled){
+        TAILQ_REMOVE(&loop->throttled, conn, throttled_entries);
+    }
+    close(conn->fd);
+    logger_log(LOG_INFO, "Closed connection from %s", conn->peer);
+    conn_release();
+    framebuf_free(&conn->fb);
+    while (!STAILQ_EMPTY(&conn->out)){
+        struct response *resp = STAILQ_FIRST(&conn->out);
+        STAILQ_REMOVE_HEAD(&conn->out, entries);
+        response_free(resp);
+    }
+    pool_free(&conn_pool, conn);
+}
+
+/*
+ * Takes a token for the next packet, or puts @param conn on the throttled
+ * list until one is available.  Returns true when the packet has to wait.
+ */
+static bool conn_throttle(struct event_loop *loop, struct conn *conn)
+{
+    uint64_t now;
+    uint64_t wait;
+
+    if(RATE_LIMIT == 0){
+        return false;
+    }
+    now = metrics_now();
+    wait = ratelimit_take(&conn->rl, RATE_LIMIT, now);
+    if(wait == 0){
+        return false;
+    }
+    conn->resume_at = now + wait;
+    if(!conn->throttled){
+        TAILQ_INSERT_TAIL(&loop->throttled, conn, throttled_entries);
+        conn->throttled = true;
+    }
+    return true;
+}
+
+/*
+ * Processes the packets framed so far and queues their responses on
+ * conn->out, as many as the rate limit and CONN_MAX_QUEUED allow, setting
+ * conn->paused if some have to wait.  Returns -1 when the connection should
+ * be closed, 0 otherwise.
+ */
+static int conn_process(struct event_loop *loop, struct conn *conn)
+{
+    const char *packet;
+    size_t packet_len;
+
+    conn->paused = false;
+    while ((packet = framebuf_next_packet(&conn->fb, &packet_len)) != NULL){
+        if(conn->queued >= CONN_MAX_QUEUED || conn_throttle(loop, conn)){
+            framebuf_unread(&conn->fb, packet_len);
+            conn->paused = true;
+            return 0;
+        }
+        logger_log(LOG_DEBUG, "Found word: %.*s", logger_dump_len(packet_len), packet);
+        struct response *resp = process_packet(conn->channel, packet, packet_len);
+        if(resp == NULL){
+            return -1;
+        }
+        resp->received = conn->received;
+        // pipelined packets, answer behind whatever is not yet sent
+        STAILQ_INSERT_TAIL(&conn->out, resp, entries);
+        conn->queued++;
+        if(!SESSION_MODE){
+            // one packet per connection, close once the echo is sent
+            conn->closing = true;
+        }
+    }
+    if(conn->fb.overflow){
+        logger_log(LOG_WARNING, "Packet from %s over %zu bytes, closing", conn->peer, MAX_PACKET_SIZE);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Reads everything available on the socket, unless packets already framed
+ * have to wait.  Returns -1 when the connection should be closed, 0
+ * otherwise.  Once a recv completes one or more packets they are processed
+ * and their responses queued on conn->out.
+ */
+static int conn_read(struct event_loop *loop, struct conn *conn)
+{
+    while (1){
+        if(conn_process(loop, conn) < 0){
+            return -1;
+        }
+        if(conn->paused || conn->closing){
+            return 0;
+        }
+
+        size_t avail;
+        char *buffer = framebuf_reserve(&conn->fb, REACTOR_RECV_SIZE, &avail);
+        if(buffer == NULL){
+            return -1;
+        }
+
+        ssize_t valread = recv(conn->fd, buffer, avail, 0);
+        if(valread < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return 0;
+            }
+            return -1;
+        }
+        if(valread == 0){
+            // peer is done sending, still answer what it already sent
+            conn->closing = true;
+            return 0;
+        }
+        conn->received = metrics_now();
+        if(conn->accepted != 0){
+            metrics_record(METRICS_FIRST_BYTE, conn->received - conn->accepted);
+            conn->accepted = 0;
+        }
+        metrics_add(METRICS_BYTES_IN, valread);
+        framebuf_commit(&conn->fb, valread);
+    }
+}
+
+/*
+ * Sends as much of the pending responses as the socket accepts.  Returns 1
+ * when all responses were fully sent, 0 when waiting for EPOLLOUT and -1 on
+ * error.
+ */
+static int conn_flush(struct conn *conn)
+{
+    struct response *resp;
+
+    if(!conn->corked){
+        response_cork(conn->fd, true);
+        conn->corked = true;
+    }
+    while ((resp = STAILQ_FIRST(&conn->out)) != NULL){
+        int rc = response_send(resp, conn->fd);
+        if(rc <= 0){
+            return rc;
+        }
+        STAILQ_REMOVE_HEAD(&conn->out, entries);
+        conn->queued--;
+        metrics_record_since(METRICS_PACKET, resp->received);
+        response_free(resp);
+    }
+    response_cork(conn->fd, false);
+    conn->corked = false;
+    return 1;
+}
+
+static void conn_handle(struct event_loop *loop, struct conn *conn, uint32_t events)
+{
+    if(events & EPOLLERR){
+        conn_close(loop, conn);
+        return;
+    }
+    // edge triggered: drain input first, it may be followed by a hang up.
+    // Packets held back by the queue of responses go as soon as sending
+    // made room for them.
+    do {
+        if(conn_read(loop, conn) < 0){
+            conn_close(loop, conn);
+            return;
+        }
+        if(loop->draining && SESSION_MODE){
+            // answer what the client already sent, then close
+            conn->closing = true;
+        }
+        if(!STAILQ_EMPTY(&conn->out) && conn_flush(conn) < 0){
+            conn_close(loop, conn);
+            return;
+        }
+    } while (conn->paused && !conn->throttled && conn->queued < CONN_MAX_QUEUED);
+    if(conn->closing && !conn->paused && STAILQ_EMPTY(&conn->out)){
+        conn_close(loop, conn);
+        return;
+    }
+    if(loop->draining){
+        // activity no longer matters, and draining walks the list
+        return;
+    }
+
+    conn->last_active = now_sec();
+    if(conn->tracked){
+        TAILQ_REMOVE(&loop->conns, conn, entries);
+    }
+    TAILQ_INSERT_TAIL(&loop->conns, conn, entries);
+    conn->tracked = true;
+}
+
+/*
+ * Closes connections whose echo made no progress for SEND_TIMEOUT seconds
+ * and, in session mode, sessions idle for longer than SESSION_IDLE_TIMEOUT.
+ * Stalled sends get no events, so both kinds are found at the head of the
+ * activity list.
+ */
+static void expire(struct event_loop *loop)
+{
+    time_t now = now_sec();
+    time_t idle_deadline = SESSION_MODE ? now - SESSION_IDLE_TIMEOUT : 0;
+    time_t send_deadline = SEND_TIMEOUT > 0 ? now - SEND_TIMEOUT : 0;
+    time_t deadline = idle_deadline > send_deadline ? idle_deadline : send_deadline;
+    struct conn *conn, *tmp;
+
+    TAILQ_FOREACH_SAFE(conn, &loop->conns, entries, tmp){
+        if(conn->last_active > deadline){
+            break;
+        }
+        if(conn->last_active <= send_deadline && !STAILQ_EMPTY(&conn->out)){
+            logger_log(LOG_INFO, "Send to %s timed out, closing", conn->peer);
+            conn_close(loop, conn);
+        }
+        else if(conn->last_active <= idle_deadline){
+            logger_log(LOG_INFO, "Session from %s idle, closing", conn->peer);
+            conn_close(loop, conn);
+        }
+    }
+}
+
+/*
+ * Resumes the throttled connections whose token is due.
+ * @return the milliseconds until the next one is, or -1 if none waits.
+ */
+static int resume_throttled(struct event_loop *loop)
+{
+    uint64_t now = metrics_now();
+    uint64_t next = UINT64_MAX;
+    struct conn *conn, *tmp;
+
+    TAILQ_FOREACH_SAFE(conn, &loop->throttled, throttled_entries, tmp){
+        if(conn->resume_at <= now){
+            TAILQ_REMOVE(&loop->throttled, conn, throttled_entries);
+            conn->throttled = false;
+            // may put it back at the tail, due later than now
+            conn_handle(loop, conn, 0);
+        }
+        else if(conn->resume_at < next){
+            next = conn->resume_at;
+        }
+    }
+    if(next == UINT64_MAX){
+        return -1;
+    }
+    // round up, waking early would only find nothing due
+    return (next - now + 999999) / 1000000;
+}
+
+static void drain(struct event_loop *loop)
+{
+    struct conn *conn, *tmp;
+
+    loop->draining = true;
+    if(!SESSION_MODE){
+        return;
+    }
+    TAILQ_FOREACH_SAFE(conn, &loop->conns, entries, tmp){
+        conn_handle(loop, conn, 0);
+    }
+}
+
+static void *event_loop_run(void *arg)
+{
+    struct event_loop *loop = arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    // wake up at least once a second to expire idle sessions and stalled
+    // sends
+    int tick = SESSION_MODE || SEND_TIMEOUT > 0 ? 1000 : -1;
+
+    while (1){
+        int timeout = resume_throttled(loop);
+        if(timeout < 0 || (tick >= 0 && tick < timeout)){
+            timeout = tick;
+        }
+        int n = epoll_wait(loop->epfd, events, REACTOR_MAX_EVENTS, timeout);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++){
+            if(events[i].data.ptr == loop){
+                loop->timer_handler(loop->timer_fd);
+                continue;
+            }
+            if(events[i].data.ptr == &drain_fd){
+                drain(loop);
+                continue;
+            }
+            conn_handle(loop, events[i].data.ptr, events[i].events);
+        }
+        if(tick >= 0 && !loop->draining){
+            expire(loop);
+        }
+    }
+    return NULL;
+}
+
+bool reactor_start(int nloops)
+{
+    if(nloops <= 0){
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nloops = ncpu > 0 ? (int) ncpu : 1;
+    }
+
+    loops = calloc(nloops, sizeof(*loops));
+    drain_fd = eventfd(0, EFD_CLOEXEC);
+    if(loops == NULL || drain_fd < 0){
+        return false;
+    }
+
+    for (int i = 0; i < nloops; i++){
+        struct epoll_event ev;
+
+        TAILQ_INIT(&loops[i].conns);
+        TAILQ_INIT(&loops[i].throttled);
+        loops[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+        if(loops[i].epfd < 0){
+            perror("epoll_create1");
+            return false;
+        }
+        // one shot, the eventfd stays readable once written
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = &drain_fd;
+        if(epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, drain_fd, &ev) < 0){
+            perror("epoll_ctl");
+            close(loops[i].epfd);
+            return false;
+        }
+        if(pthread_create(&loops[i].thread, NULL, event_loop_run, &loops[i]) != 0){
+            perror("pthread_create");
+            close(loops[i].epfd);
+            return false;
+        }
+        nr_loops++;
+    }
+    printf("Started %d event loops\n", nr_loops);
+    return true;
+}
+
+bool reactor_add(int fd, const char *peer, uint64_t accepted)
+{
+    struct event_loop *loop;
+    struct epoll_event ev;
+    struct conn *conn;
+
+    conn = pool_alloc(&conn_pool);
+    if(conn == NULL){
+        return false;
+    }
+    conn->channel = channel_of(fd);
+    if(conn->channel == NULL){
+        logger_log(LOG_ERR, "No channel for the connection from %s", peer);
+        pool_free(&conn_pool, conn);
+        return false;
+    }
+    conn->fd = fd;
+    conn->accepted = accepted;
+    framebuf_init(&conn->fb, MAX_PACKET_SIZE);
+    STAILQ_INIT(&conn->out);
+    snprintf(conn->peer, sizeof(conn->peer), "%s", peer);
+
+    // several accept threads may hand out connections at once
+    loop = &loops[__atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED) % nr_loops];
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0){
+        perror("epoll_ctl");
+        pool_free(&conn_pool, conn);
+        return false;
+    }
+    return true;
+}
+
+bool reactor_add_timer(int fd, reactor_timer_handler_t handler)
+{
+    struct event_loop *loop = &loops[0];
+    struct epoll_event ev;
+
+    loop->timer_fd = fd;
+    loop->timer_handler = handler;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = loop;
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0){
+        perror("epoll_ctl");
+        return false;
+    }
+    return true;
+}
+
+void reactor_drain(void)
+{
+    eventfd_write(drain_fd, 1);
+}
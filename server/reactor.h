@@ -0,0 +1,50 @@
+/*
+ * reactor.h
+ *
+ *  @brief Edge triggered epoll event loops for aesdsocket.  A fixed set of
+ *  event loop threads (one per online cpu by default) each multiplex many
+ *  non-blocking connections instead of spawning a thread per connection.
+ */
+
+#ifndef AESDSOCKET_REACTOR_H
+#define AESDSOCKET_REACTOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Starts @param nloops event loop threads.  Pass 0 to use one loop per online
+ * cpu.
+ * @return true if all event loops were started.
+ */
+bool reactor_start(int nloops);
+
+/**
+ * Hands the accepted non-blocking connection @param fd to one of the event
+ * loops.  The descriptor is owned (and eventually closed) by the event loop
+ * on success, which also gives back its admission slot.  @param peer is the printable peer
+ * address used for logging, @param accepted the metrics_now() time the
+ * connection was accepted.
+ * @return true if the connection was registered with an event loop.
+ */
+bool reactor_add(int fd, const char *peer, uint64_t accepted);
+
+/**
+ * Called on an event loop thread once the timer @param fd is readable.
+ */
+typedef void (*reactor_timer_handler_t)(int fd);
+
+/**
+ * Serves the non-blocking timer @param fd (a timerfd) from the first event
+ * loop, calling @param handler whenever it expires.
+ * @return true if the timer was registered.
+ */
+bool reactor_add_timer(int fd, reactor_timer_handler_t handler);
+
+/**
+ * Tells the event loops to close their sessions once the packets already
+ * received are answered.  Single packet connections are left to finish.
+ */
+void reactor_drain(void);
+
+#endif /* AESDSOCKET_REACTOR_H */
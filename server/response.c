@@ -0,0 +1,228 @@
+/**
+ * @file response.c
+ * @brief Echo of the backing store with sendfile and a buffered fallback
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "logger.h"
+#include "metrics.h"
+#include "response.h"
+
+struct response *response_new(int fd, off_t offset)
+{
+    struct response *resp = calloc(1, sizeof(*resp));
+    if(resp == NULL){
+        close(fd);
+        return NULL;
+    }
+    resp->fd = fd;
+    resp->offset = offset;
+    resp->remaining = SIZE_MAX;
+
+    struct stat st;
+    if(fstat(fd, &st) < 0){
+        response_free(resp);
+        return NULL;
+    }
+    if(S_ISREG(st.st_mode)){
+        resp->remaining = st.st_size > offset ? st.st_size - offset : 0;
+    }
+    // devices are read until they report the end of their contents
+    return resp;
+}
+
+struct response *response_new_snapshot(struct datalog *log)
+{
+    struct datalog_snapshot snap;
+    struct response *resp = calloc(1, sizeof(*resp));
+    if(resp == NULL){
+        return NULL;
+    }
+    datalog_snapshot(log, &snap);
+    resp->fd = -1;
+    resp->seg = snap.seg;
+    resp->seg_off = snap.off;
+    resp->remaining = snap.len;
+    resp->pinned = snap.pinned;
+    return resp;
+}
+
+void response_free(struct response *resp)
+{
+    if(resp->fd >= 0){
+        close(resp->fd);
+    }
+    if(resp->pinned != NULL){
+        datalog_release(resp->pinned);
+    }
+    free(resp->buf);
+    free(resp);
+}
+
+/*
+ * Fallback for backing files without splice support: read a chunk at a
+ * time and send it, keeping whatever the socket didn't take for later.
+ */
+static int response_send_buffered(struct response *resp, int sockfd)
+{
+    if(resp->buf == NULL){
+        resp->buf = malloc(RESPONSE_READ_SIZE);
+        if(resp->buf == NULL){
+            return -1;
+        }
+    }
+    while (1){
+        if(resp->buf_sent == resp->buf_len){
+            if(resp->remaining == 0){
+                return 1;
+            }
+            size_t count = resp->remaining < RESPONSE_READ_SIZE ? resp->remaining : RESPONSE_READ_SIZE;
+            ssize_t nread = pread(resp->fd, resp->buf, count, resp->offset);
+            if(nread < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                return -1;
+            }
+            if(nread == 0){
+                // end of the device, or truncated underneath us
+                return 1;
+            }
+            resp->buf_len = nread;
+            resp->buf_sent = 0;
+            resp->offset += nread;
+            resp->remaining -= nread;
+        }
+        ssize_t sent = send(sockfd, resp->buf + resp->buf_sent,
+                            resp->buf_len - resp->buf_sent, MSG_NOSIGNAL | MSG_MORE);
+        if(sent < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return 0;
+            }
+            logger_log(LOG_ERR, "Fail send %s", strerror(errno));
+            return -1;
+        }
+        resp->buf_sent += sent;
+        metrics_add(METRICS_BYTES_OUT, sent);
+    }
+}
+
+int response_snapshot_iov(const struct response *resp, struct iovec *iov, int max)
+{
+    const struct datalog_seg *seg = resp->seg;
+    size_t off = resp->seg_off;
+    size_t left = resp->remaining;
+    int iovcnt = 0;
+
+    while (left > 0 && iovcnt < max){
+        size_t n = DATALOG_SEG_SIZE - off;
+        if(n > left){
+            n = left;
+        }
+        iov[iovcnt].iov_base = (void *) (seg->data + off);
+        iov[iovcnt].iov_len = n;
+        iovcnt++;
+        left -= n;
+        seg = seg->next;
+        off = 0;
+    }
+    return iovcnt;
+}
+
+void response_snapshot_advance(struct response *resp, size_t sent)
+{
+    metrics_add(METRICS_BYTES_OUT, sent);
+    resp->remaining -= sent;
+    sent += resp->seg_off;
+    while (resp->remaining > 0 && sent >= DATALOG_SEG_SIZE){
+        resp->seg = resp->seg->next;
+        sent -= DATALOG_SEG_SIZE;
+    }
+    resp->seg_off = sent;
+}
+
+/*
+ * Sends the rest of a data log snapshot, gathering up to RESPONSE_IOV_MAX
+ * segments per call.
+ */
+static int response_send_snapshot(struct response *resp, int sockfd)
+{
+    struct iovec iov[RESPONSE_IOV_MAX];
+    struct msghdr msg;
+
+    while (resp->remaining > 0){
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = response_snapshot_iov(resp, iov, RESPONSE_IOV_MAX);
+        ssize_t sent = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+        if(sent < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return 0;
+            }
+            logger_log(LOG_ERR, "Fail send %s", strerror(errno));
+            return -1;
+        }
+        response_snapshot_advance(resp, sent);
+    }
+    return 1;
+}
+
+int response_send(struct response *resp, int sockfd)
+{
+    if(resp->fd < 0){
+        return response_send_snapshot(resp, sockfd);
+    }
+    while (!resp->buffered){
+        if(resp->remaining == 0){
+            return 1;
+        }
+        // advances our offset, not the file position
+        size_t count = resp->remaining < RESPONSE_SENDFILE_MAX ? resp->remaining : RESPONSE_SENDFILE_MAX;
+        ssize_t sent = sendfile(sockfd, resp->fd, &resp->offset, count);
+        if(sent == 0){
+            // truncated underneath us
+            return 1;
+        }
+        if(sent > 0){
+            resp->remaining -= sent;
+            metrics_add(METRICS_BYTES_OUT, sent);
+            continue;
+        }
+        if(errno == EINTR){
+            continue;
+        }
+        if(errno == EAGAIN || errno == EWOULDBLOCK){
+            return 0;
+        }
+        if(errno == EINVAL || errno == ENOSYS){
+            // the char device has no splice_read, read it ourselves
+            resp->buffered = true;
+            break;
+        }
+        logger_log(LOG_ERR, "Fail sendfile %s", strerror(errno));
+        return -1;
+    }
+    return response_send_buffered(resp, sockfd);
+}
+
+void response_cork(int sockfd, bool on)
+{
+    int val = on;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &val, sizeof(val));
+}
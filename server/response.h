@@ -0,0 +1,110 @@
+/*
+ * response.h
+ *
+ *  @brief Streams the echo of the backing store to a client socket.  A
+ *  snapshot of the in memory data log is sent straight from its segments
+ *  with scatter/gather I/O.  A backing file is sent with sendfile() so the
+ *  data never passes through user space, falling back to buffered reads for
+ *  files sendfile can't read from (such as the aesdchar device).
+ */
+
+#ifndef AESDSOCKET_RESPONSE_H
+#define AESDSOCKET_RESPONSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "datalog.h"
+#include "queue.h"
+
+#define RESPONSE_READ_SIZE 65536
+// largest count a single sendfile() call transfers
+#define RESPONSE_SENDFILE_MAX 0x7ffff000
+// segments handed to a single sendmsg() call
+#define RESPONSE_IOV_MAX 64
+
+struct response
+{
+    /**
+     * Backing file, or -1 when sending a data log snapshot, and the offset
+     * of its next byte to send.  Reads go to the offset, leaving the file
+     * position alone
+     */
+    int fd;
+    off_t offset;
+    /**
+     * Data log segment holding the next byte to send and its offset in it
+     */
+    const struct datalog_seg *seg;
+    size_t seg_off;
+    /**
+     * Data log segment the snapshot pinned, released with the response
+     */
+    struct datalog_seg *pinned;
+    /**
+     * Bytes left to send.  For regular files this is the length when the
+     * response was created so later appends are left to their own echo
+     */
+    size_t remaining;
+    /**
+     * Set once sendfile was refused for fd, the rest is sent from buf
+     */
+    bool buffered;
+    /**
+     * Bytes read from fd but not yet accepted by the socket, buffered mode only
+     */
+    char *buf;
+    size_t buf_len;
+    size_t buf_sent;
+    /**
+     * metrics_now() time the packet being answered was received, set by the
+     * caller
+     */
+    uint64_t received;
+    STAILQ_ENTRY(response) entries;
+};
+
+STAILQ_HEAD(response_queue, response);
+
+/**
+ * @return a response streaming @param fd from @param offset to its current
+ * end, or NULL on error.  The response owns fd.
+ */
+extern struct response *response_new(int fd, off_t offset);
+
+/**
+ * @return a response sending the window currently published in @param log,
+ * or NULL if out of memory.
+ */
+extern struct response *response_new_snapshot(struct datalog *log);
+
+extern void response_free(struct response *resp);
+
+/**
+ * Sends as much of @param resp as @param sockfd accepts.
+ * @return 1 once the end of the backing file was sent, 0 when the socket
+ * would block and -1 on error.
+ */
+extern int response_send(struct response *resp, int sockfd);
+
+/**
+ * Fills up to @param max entries of @param iov with the unsent part of the
+ * data log snapshot @param resp, for callers submitting their own sends.
+ * @return the number of entries used, 0 once everything was sent.
+ */
+extern int response_snapshot_iov(const struct response *resp, struct iovec *iov, int max);
+
+/**
+ * Marks @param sent more bytes of the data log snapshot @param resp as sent.
+ */
+extern void response_snapshot_advance(struct response *resp, size_t sent);
+
+/**
+ * Sets TCP_CORK on @param sockfd while @param on, so responses are sent in
+ * full segments and flushed once it is cleared.
+ */
+extern void response_cork(int sockfd, bool on);
+
+#endif /* AESDSOCKET_RESPONSE_H */
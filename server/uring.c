@@ -0,0 +1,1085 @@
+/**
+ * @file uring.c
+ * @brief io_uring event loops serving aesdsocket connections
+ *
+ * Each loop thread sets up its own ring with the raw io_uring syscalls and
+ * keeps one multishot accept armed on its listener.  Accepted connections
+ * get a multishot recv which picks buffers from a ring of provided buffers
+ * registered with the kernel, so no recv is issued per packet.  Received
+ * bytes are copied into the connection's framebuf and complete packets go
+ * through process_packet() as in the other handlers.  Data log snapshots
+ * are answered with IORING_OP_SENDMSG gathering the log segments, device
+ * responses with response_send() on the non-blocking socket, waiting for
+ * POLLOUT through the ring when it fills.
+ *
+ * A connection is freed only once every operation it has in flight has
+ * completed, so closing it cancels them first.  In session mode a timeout
+ * fires every second to close idle sessions, using the same least recently
+ * active list as the epoll reactor.
+ *
+ * A connection whose packets have to wait, for the rate limit or behind
+ * CONN_MAX_QUEUED unsent responses, cancels its recv until they can go, so
+ * the client is held back by its own socket buffer.  Rate limited
+ * connections wait on a list of their loop, woken by an absolute timeout
+ * for the earliest of them.  The one second timeout also closes
+ * connections whose echo made no progress for SEND_TIMEOUT seconds.
+ *
+ * Every loop also polls an eventfd written when the server drains.  The
+ * loop then cancels its accept and closes its sessions once their queued
+ * responses are sent.
+ *
+ * The backend is only built against kernel headers providing everything
+ * above (multishot recv arrived last, in 6.0).  Against older ones
+ * uring_start() always fails, and the server falls back to epoll as it
+ * does on an older running kernel.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __has_include
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include "aesdsocket.h"
+#include "channel.h"
+#include "framebuf.h"
+#include "logger.h"
+#include "metrics.h"
+#include "pool.h"
+#include "queue.h"
+#include "ratelimit.h"
+#include "response.h"
+#include "uring.h"
+
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT) && \
+    defined(IORING_ASYNC_CANCEL_FD) && defined(__NR_io_uring_setup)
+#define URING_SUPPORTED 1
+#endif
+
+#ifdef URING_SUPPORTED
+
+#define URING_ENTRIES 256
+// provided receive buffers per loop, must be a power of two
+#define URING_BUF_COUNT 256
+#define URING_BUF_SIZE 4096
+#define URING_BGID 0
+
+// operation a completion belongs to, kept in the low bits of user_data
+enum uring_op {
+    URING_OP_ACCEPT,
+    URING_OP_ACCEPT_POLL,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_SEND_POLL,
+    URING_OP_TIMEOUT,
+    URING_OP_CANCEL,
+    URING_OP_DRAIN,
+};
+#define URING_OP_MASK 7
+
+struct uconn {
+    int fd;
+    char peer[INET6_ADDRSTRLEN];
+    struct framebuf fb;
+    // responses being sent back, in packet order, and their number
+    struct response_queue out;
+    int queued;
+    // the sendmsg in flight gathers from these
+    struct iovec iov[RESPONSE_IOV_MAX];
+    struct msghdr msg;
+    // operations submitted which will still complete
+    int inflight;
+    bool recv_armed;
+    // framed packets wait for the rate limit or for responses to be sent,
+    // the recv was cancelled meanwhile
+    bool paused;
+    bool recv_cancelled;
+    // a send or a poll for POLLOUT is in flight
+    bool sending;
+    // no more packets are read, close once the responses are sent
+    bool closing;
+    // being closed, freed once nothing is in flight
+    bool dead;
+    time_t last_active;
+    // metrics_now() time of the accept, 0 once the first byte arrived
+    uint64_t accepted;
+    // metrics_now() time of the last recv
+    uint64_t received;
+    struct ratelimit rl;
+    // on the loop's throttled list until resume_at, a metrics_now() time
+    bool throttled;
+    uint64_t resume_at;
+    TAILQ_ENTRY(uconn) entries;
+    TAILQ_ENTRY(uconn) throttled_entries;
+};
+
+struct uring_loop {
+    pthread_t thread;
+    int listen_fd;
+    // channel the listener serves, NULL for a foreign one handed over
+    struct channel *channel;
+
+    int ring_fd;
+    // the mapping shared by both rings, and the submission entries
+    char *ring;
+    size_t ring_len;
+    size_t sqes_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // provided buffer ring and the buffers it hands out
+    struct io_uring_buf_ring *br;
+    char *bufs;
+
+    struct __kernel_timespec tick;
+    // connections ordered from least to most recently active
+    TAILQ_HEAD(, uconn) conns;
+    // connections waiting for the rate limit, and the timeout for the
+    // earliest of them, whose completions carry the list's address
+    TAILQ_HEAD(, uconn) throttled;
+    struct __kernel_timespec resume_ts;
+    bool resume_armed;
+    bool draining;
+    // set when starting the loops failed, the thread returns
+    bool stopped;
+};
+
+static struct uring_loop *loops;
+static int nr_loops;
+// readable once the loops should drain
+static int drain_fd = -1;
+// set before drain_fd is signalled when starting the loops failed, the
+// loops started already stop instead of draining
+static bool aborting;
+static struct pool uconn_pool = POOL_INITIALIZER(struct uconn);
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static time_t now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/*
+ * Submits everything queued and, when @param wait is set, waits for at
+ * least one completion in the same call.
+ */
+static int ring_submit(struct uring_loop *loop, unsigned wait)
+{
+    unsigned pending = *loop->sq_tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+    int rc;
+
+    do {
+        rc = sys_io_uring_enter(loop->ring_fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+    } while (rc < 0 && errno == EINTR);
+    return rc;
+}
+
+/*
+ * Returns a cleared submission entry.  Without SQPOLL the kernel only looks
+ * at the queue in io_uring_enter, so the entry may be published right away
+ * and filled in by the caller.
+ */
+static struct io_uring_sqe *ring_get_sqe(struct uring_loop *loop, void *ptr, enum uring_op op)
+{
+    unsigned tail = *loop->sq_tail;
+    struct io_uring_sqe *sqe;
+
+    if(tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE) >= loop->sq_entries){
+        ring_submit(loop, 0);
+        if(tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE) >= loop->sq_entries){
+            return NULL;
+        }
+    }
+    sqe = &loop->sqes[tail & loop->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uintptr_t) ptr | op;
+    __atomic_store_n(loop->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+static void buf_recycle(struct uring_loop *loop, unsigned bid)
+{
+    unsigned short tail = loop->br->tail;
+    struct io_uring_buf *buf = &loop->br->bufs[tail & (URING_BUF_COUNT - 1)];
+
+    buf->addr = (uintptr_t) (loop->bufs + (size_t) bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&loop->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void arm_accept(struct uring_loop *loop)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe(loop, loop, URING_OP_ACCEPT);
+    if(sqe == NULL){
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+static void arm_accept_poll(struct uring_loop *loop)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe(loop, loop, URING_OP_ACCEPT_POLL);
+    if(sqe == NULL){
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->listen_fd;
+    sqe->poll32_events = POLLIN;
+}
+
+static void arm_timeout(struct uring_loop *loop)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe(loop, loop, URING_OP_TIMEOUT);
+    if(sqe == NULL){
+        return;
+    }
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t) &loop->tick;
+    sqe->len = 1;
+}
+
+/*
+ * Arms the timeout for the earliest throttled connection, unless it is
+ * armed already.
+ */
+static void arm_resume(struct uring_loop *loop)
+{
+    struct io_uring_sqe *sqe;
+    struct uconn *conn;
+    uint64_t next = UINT64_MAX;
+
+    if(loop->resume_armed || TAILQ_EMPTY(&loop->throttled)){
+        return;
+    }
+    TAILQ_FOREACH(conn, &loop->throttled, throttled_entries){
+        if(conn->resume_at < next){
+            next = conn->resume_at;
+        }
+    }
+    sqe = ring_get_sqe(loop, &loop->throttled, URING_OP_TIMEOUT);
+    if(sqe == NULL){
+        return;
+    }
+    // absolute on CLOCK_MONOTONIC, the clock of metrics_now()
+    loop->resume_ts.tv_sec = next / 1000000000;
+    loop->resume_ts.tv_nsec = next % 1000000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t) &loop->resume_ts;
+    sqe->len = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;
+    loop->resume_armed = true;
+}
+
+static void arm_drain_poll(struct uring_loop *loop)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe(loop, loop, URING_OP_DRAIN);
+    if(sqe == NULL){
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = drain_fd;
+    sqe->poll32_events = POLLIN;
+}
+
+static bool arm_recv(struct uring_loop *loop, struct uconn *conn)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe(loop, conn, URING_OP_RECV);
+    if(sqe == NULL){
+        return false;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    conn->recv_armed = true;
+    conn->recv_cancelled = false;
+    conn->inflight++;
+    return true;
+}
+
+static void cancel_recv(struct uring_loop *loop, struct uconn *conn)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe(loop, loop, URING_OP_CANCEL);
+    if(sqe == NULL){
+        // keeps receiving, into the framebuf for later
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t) conn | URING_OP_RECV;
+    conn->recv_cancelled = true;
+}
+
+static bool arm_send_poll(struct uring_loop *loop, struct uconn *conn)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe(loop, conn, URING_OP_SEND_POLL);
+    if(sqe == NULL){
+        return false;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->fd;
+    sqe->poll32_events = POLLOUT;
+    conn->sending = true;
+    conn->inflight++;
+    return true;
+}
+
+static void conn_touch(struct uring_loop *loop, struct uconn *conn)
+{
+    conn->last_active = now_sec();
+    TAILQ_REMOVE(&loop->conns, conn, entries);
+    TAILQ_INSERT_TAIL(&loop->conns, conn, entries);
+}
+
+/*
+ * Frees a closed connection once its last operation completed.
+ */
+static void conn_put(struct uconn *conn)
+{
+    if(!conn->dead || conn->inflight > 0){
+        return;
+    }
+    close(conn->fd);
+    logger_log(LOG_INFO, "Closed connection from %s", conn->peer);
+    conn_release();
+    framebuf_free(&conn->fb);
+    while (!STAILQ_EMPTY(&conn->out)){
+        struct response *resp = STAILQ_FIRST(&conn->out);
+        STAILQ_REMOVE_HEAD(&conn->out, entries);
+        response_free(resp);
+    }
+    pool_free(&uconn_pool, conn);
+}
+
+/*
+ * Closes @param conn, cancelling whatever it still has in flight.  The
+ * connection must not be used by the caller afterwards.
+ */
+static void conn_close(struct uring_loop *loop, struct uconn *conn)
+{
+    if(conn->dead){
+        return;
+    }
+    conn->dead = true;
+    TAILQ_REMOVE(&loop->conns, conn, entries);
+    if(conn->throttled){
+        TAILQ_REMOVE(&loop->throttled, conn, throttled_entries);
+        conn->throttled = false;
+    }
+
+    if(conn->inflight > 0){
+        struct io_uring_sqe *sqe = ring_get_sqe(loop, loop, URING_OP_CANCEL);
+        if(sqe != NULL){
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = conn->fd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        }
+        else{
+            // no room to cancel, make the pending operations fail instead
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    }
+    conn_put(conn);
+}
+
+/*
+ * Takes a token for the next packet, or puts @param conn on the throttled
+ * list until one is available.  Returns true when the packet has to wait.
+ */
+static bool conn_throttle(struct uring_loop *loop, struct uconn *conn)
+{
+    uint64_t now;
+    uint64_t wait;
+
+    if(RATE_LIMIT == 0){
+        return false;
+    }
+    now = metrics_now();
+    wait = ratelimit_take(&conn->rl, RATE_LIMIT, now);
+    if(wait == 0){
+        return false;
+    }
+    conn->resume_at = now + wait;
+    if(!conn->throttled){
+        TAILQ_INSERT_TAIL(&loop->throttled, conn, throttled_entries);
+        conn->throttled = true;
+    }
+    return true;
+}
+
+/*
+ * Processes the packets framed so far and queues their responses, as many
+ * as the rate limit and CONN_MAX_QUEUED allow.  Keeps the recv armed only
+ * while no packet has to wait.  Returns false if the connection should be
+ * closed.
+ */
+static bool conn_process(struct uring_loop *loop, struct uconn *conn)
+{
+    const char *packet;
+    size_t packet_len;
+
+    conn->paused = false;
+    while ((packet = framebuf_next_packet(&conn->fb, &packet_len)) != NULL){
+        if(conn->queued >= CONN_MAX_QUEUED || conn_throttle(loop, conn)){
+            framebuf_unread(&conn->fb, packet_len);
+            conn->paused = true;
+            break;
+        }
+        logger_log(LOG_DEBUG, "Found word: %.*s", logger_dump_len(packet_len), packet);
+        struct response *resp = process_packet(loop->channel, packet, packet_len);
+        if(resp == NULL){
+            return false;
+        }
+        resp->received = conn->received;
+        // pipelined packets, answer behind whatever is not yet sent
+        STAILQ_INSERT_TAIL(&conn->out, resp, entries);
+        conn->queued++;
+        if(!SESSION_MODE){
+            // one packet per connection, close once the echo is sent
+            conn->closing = true;
+        }
+    }
+    if(conn->fb.overflow){
+        logger_log(LOG_WARNING, "Packet from %s over %zu bytes, closing", conn->peer, MAX_PACKET_SIZE);
+        return false;
+    }
+    if(conn->paused){
+        if(conn->recv_armed && !conn->recv_cancelled){
+            cancel_recv(loop, conn);
+        }
+    }
+    else if(!conn->recv_armed && !conn->closing && !arm_recv(loop, conn)){
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Sends the queued responses, one submission at a time.  Closes the
+ * connection once everything was sent and no more packets are read.
+ */
+static void conn_kick(struct uring_loop *loop, struct uconn *conn)
+{
+    struct response *resp;
+
+    while (!conn->sending && !conn->dead){
+        // sending made room for packets held back behind the responses
+        if(conn->paused && !conn->throttled && conn->queued < CONN_MAX_QUEUED &&
+           !conn_process(loop, conn)){
+            conn_close(loop, conn);
+            return;
+        }
+        resp = STAILQ_FIRST(&conn->out);
+        if(resp == NULL){
+            if(conn->closing && !conn->paused){
+                conn_close(loop, conn);
+            }
+            return;
+        }
+
+        if(resp->fd < 0){
+            int iovcnt = response_snapshot_iov(resp, conn->iov, RESPONSE_IOV_MAX);
+            if(iovcnt == 0){
+                STAILQ_REMOVE_HEAD(&conn->out, entries);
+                conn->queued--;
+                metrics_record_since(METRICS_PACKET, resp->received);
+                response_free(resp);
+                continue;
+            }
+
+            size_t len = 0;
+            for (int i = 0; i < iovcnt; i++){
+                len += conn->iov[i].iov_len;
+            }
+            memset(&conn->msg, 0, sizeof(conn->msg));
+            conn->msg.msg_iov = conn->iov;
+            conn->msg.msg_iovlen = iovcnt;
+
+            struct io_uring_sqe *sqe = ring_get_sqe(loop, conn, URING_OP_SEND);
+            if(sqe == NULL){
+                conn_close(loop, conn);
+                return;
+            }
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = conn->fd;
+            sqe->addr = (uintptr_t) &conn->msg;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            if(len < resp->remaining || STAILQ_NEXT(resp, entries) != NULL){
+                // more follows, let the stack fill whole segments
+                sqe->msg_flags |= MSG_MORE;
+            }
+            conn->sending = true;
+            conn->inflight++;
+            return;
+        }
+
+        // backing files are streamed directly, waiting for POLLOUT when full
+        int rc = response_send(resp, conn->fd);
+        if(rc == 1){
+            STAILQ_REMOVE_HEAD(&conn->out, entries);
+            conn->queued--;
+            metrics_record_since(METRICS_PACKET, resp->received);
+            response_free(resp);
+            continue;
+        }
+        if(rc < 0 || !arm_send_poll(loop, conn)){
+            conn_close(loop, conn);
+        }
+        return;
+    }
+}
+
+/*
+ * Frames @param len received bytes.  Returns false if the connection should
+ * be closed.
+ */
+static bool conn_input(struct uconn *conn, const char *data, size_t len)
+{
+    uint64_t received = metrics_now();
+    size_t avail;
+    char *buffer = framebuf_reserve(&conn->fb, len, &avail);
+    if(buffer == NULL){
+        return false;
+    }
+    memcpy(buffer, data, len);
+    framebuf_commit(&conn->fb, len);
+    if(conn->accepted != 0){
+        metrics_record(METRICS_FIRST_BYTE, received - conn->accepted);
+        conn->accepted = 0;
+    }
+    metrics_add(METRICS_BYTES_IN, len);
+    conn->received = received;
+    return true;
+}
+
+static void handle_accept(struct uring_loop *loop, int res, unsigned flags)
+{
+    if(!(flags & IORING_CQE_F_MORE) && !loop->draining){
+        // the multishot accept ended, wait for the listener before rearming
+        arm_accept_poll(loop);
+    }
+    if(res < 0){
+        return;
+    }
+
+    if(loop->channel == NULL || !conn_try_admit()){
+        setsockopt(res, SOL_SOCKET, SO_LINGER,
+                   &(struct linger){ .l_onoff = 1, .l_linger = 0 }, sizeof(struct linger));
+        close(res);
+        metrics_add(METRICS_REJECTED, 1);
+        return;
+    }
+    metrics_add(METRICS_ACCEPTED, 1);
+
+    struct uconn *conn = pool_alloc(&uconn_pool);
+    if(conn == NULL){
+        close(res);
+        conn_release();
+        return;
+    }
+    conn->fd = res;
+    conn->accepted = metrics_now();
+    framebuf_init(&conn->fb, MAX_PACKET_SIZE);
+    STAILQ_INIT(&conn->out);
+
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    if(getpeername(res, (struct sockaddr *) &addr, &addrlen) == 0){
+        format_peer(&addr, conn->peer, sizeof(conn->peer));
+    }
+    logger_log(LOG_INFO, "Accepted connection from %s", conn->peer);
+
+    conn->last_active = now_sec();
+    TAILQ_INSERT_TAIL(&loop->conns, conn, entries);
+    if(!arm_recv(loop, conn)){
+        conn_close(loop, conn);
+    }
+}
+
+static void handle_recv(struct uring_loop *loop, struct uconn *conn, int res, unsigned flags)
+{
+    if(!(flags & IORING_CQE_F_MORE)){
+        conn->recv_armed = false;
+        conn->inflight--;
+    }
+    bool ok = true;
+    if(flags & IORING_CQE_F_BUFFER){
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if(res > 0 && !conn->dead && !conn->closing){
+            ok = conn_input(conn, loop->bufs + (size_t) bid * URING_BUF_SIZE, res);
+        }
+        buf_recycle(loop, bid);
+    }
+    if(conn->dead){
+        conn_put(conn);
+        return;
+    }
+
+    if(res == 0 || (loop->draining && SESSION_MODE)){
+        // peer is done sending or the server drains, still answer what
+        // was already received
+        conn->closing = true;
+    }
+    // running out of provided buffers only ends the multishot recv, as
+    // does pausing it
+    if(!ok || (res < 0 && res != -ENOBUFS && res != -EAGAIN && res != -ECANCELED)){
+        conn_close(loop, conn);
+        return;
+    }
+    // rearms the recv unless packets wait
+    if(!conn_process(loop, conn)){
+        conn_close(loop, conn);
+        return;
+    }
+    conn_touch(loop, conn);
+    conn_kick(loop, conn);
+}
+
+static void handle_send(struct uring_loop *loop, struct uconn *conn, enum uring_op op, int res)
+{
+    conn->inflight--;
+    conn->sending = false;
+    if(conn->dead){
+        conn_put(conn);
+        return;
+    }
+
+    if(op == URING_OP_SEND){
+        if(res == -EAGAIN){
+            if(!arm_send_poll(loop, conn)){
+                conn_close(loop, conn);
+            }
+            return;
+        }
+        if(res < 0){
+            logger_log(LOG_ERR, "Fail send %s", strerror(-res));
+            conn_close(loop, conn);
+            return;
+        }
+        response_snapshot_advance(STAILQ_FIRST(&conn->out), res);
+    }
+    conn_touch(loop, conn);
+    conn_kick(loop, conn);
+}
+
+/*
+ * Closes connections whose echo made no progress for SEND_TIMEOUT seconds
+ * and, in session mode, sessions idle for longer than SESSION_IDLE_TIMEOUT.
+ * A stalled send never completes, so both kinds are found at the head of
+ * the activity list.
+ */
+static void expire(struct uring_loop *loop)
+{
+    time_t now = now_sec();
+    time_t idle_deadline = SESSION_MODE ? now - SESSION_IDLE_TIMEOUT : 0;
+    time_t send_deadline = SEND_TIMEOUT > 0 ? now - SEND_TIMEOUT : 0;
+    time_t deadline = idle_deadline > send_deadline ? idle_deadline : send_deadline;
+    struct uconn *conn, *tmp;
+
+    TAILQ_FOREACH_SAFE(conn, &loop->conns, entries, tmp){
+        if(conn->last_active > deadline){
+            break;
+        }
+        if(conn->last_active <= send_deadline && !STAILQ_EMPTY(&conn->out)){
+            logger_log(LOG_INFO, "Send to %s timed out, closing", conn->peer);
+            conn_close(loop, conn);
+        }
+        else if(conn->last_active <= idle_deadline){
+            logger_log(LOG_INFO, "Session from %s idle, closing", conn->peer);
+            conn_close(loop, conn);
+        }
+    }
+}
+
+/*
+ * Resumes the throttled connections whose token is due.
+ */
+static void resume_throttled(struct uring_loop *loop)
+{
+    uint64_t now = metrics_now();
+    struct uconn *conn, *tmp;
+
+    loop->resume_armed = false;
+    TAILQ_FOREACH_SAFE(conn, &loop->throttled, throttled_entries, tmp){
+        if(conn->resume_at > now){
+            continue;
+        }
+        TAILQ_REMOVE(&loop->throttled, conn, throttled_entries);
+        conn->throttled = false;
+        // may put it back at the tail, due later than now
+        if(!conn_process(loop, conn)){
+            conn_close(loop, conn);
+            continue;
+        }
+        conn_kick(loop, conn);
+    }
+}
+
+static void drain(struct uring_loop *loop)
+{
+    struct uconn *conn, *tmp;
+    struct io_uring_sqe *sqe;
+
+    loop->draining = true;
+    // cancels the accept, or the poll waiting to rearm it
+    sqe = ring_get_sqe(loop, loop, URING_OP_CANCEL);
+    if(sqe != NULL){
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = loop->listen_fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    }
+    if(!SESSION_MODE){
+        return;
+    }
+    TAILQ_FOREACH_SAFE(conn, &loop->conns, entries, tmp){
+        conn->closing = true;
+        conn_kick(loop, conn);
+    }
+}
+
+static void handle_cqe(struct uring_loop *loop, uint64_t user_data, int res, unsigned flags)
+{
+    void *ptr = (void *) (uintptr_t) (user_data & ~(uint64_t) URING_OP_MASK);
+    enum uring_op op = user_data & URING_OP_MASK;
+
+    switch (op){
+        case URING_OP_ACCEPT:
+            handle_accept(loop, res, flags);
+            break;
+        case URING_OP_ACCEPT_POLL:
+            if(!loop->draining){
+                arm_accept(loop);
+            }
+            break;
+        case URING_OP_RECV:
+            handle_recv(loop, ptr, res, flags);
+            break;
+        case URING_OP_SEND:
+        case URING_OP_SEND_POLL:
+            handle_send(loop, ptr, op, res);
+            break;
+        case URING_OP_TIMEOUT:
+            if(ptr == &loop->throttled){
+                resume_throttled(loop);
+            }
+            else if(!loop->draining){
+                expire(loop);
+                arm_timeout(loop);
+            }
+            break;
+        case URING_OP_CANCEL:
+            break;
+        case URING_OP_DRAIN:
+            if(__atomic_load_n(&aborting, __ATOMIC_ACQUIRE)){
+                loop->stopped = true;
+            }
+            else{
+                drain(loop);
+            }
+            break;
+    }
+}
+
+static void *uring_loop_run(void *arg)
+{
+    struct uring_loop *loop = arg;
+
+    arm_accept(loop);
+    arm_drain_poll(loop);
+    if(SESSION_MODE || SEND_TIMEOUT > 0){
+        arm_timeout(loop);
+    }
+
+    while (!loop->stopped){
+        if(ring_submit(loop, 1) < 0){
+            perror("io_uring_enter");
+            break;
+        }
+        unsigned head = *loop->cq_head;
+        while (head != __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE)){
+            struct io_uring_cqe *cqe = &loop->cqes[head & loop->cq_mask];
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+
+            // hand the entry back before handling it, handlers may submit
+            head++;
+            __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+            handle_cqe(loop, user_data, res, flags);
+        }
+        arm_resume(loop);
+    }
+    return NULL;
+}
+
+/*
+ * Checks for the features the backend relies on.  Multishot recv and the
+ * zero copy send opcode arrived in the same kernel release, and the opcode
+ * can be probed for.
+ */
+static bool ring_probe(int ring_fd)
+{
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    bool supported;
+
+    if(probe == NULL){
+        return false;
+    }
+    supported = sys_io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+                probe->last_op >= IORING_OP_SEND_ZC &&
+                (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+/*
+ * Undoes what ring_init() set up of @param loop, however far it got.
+ */
+static void ring_free(struct uring_loop *loop)
+{
+    if(loop->br != NULL){
+        munmap(loop->br, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+        loop->br = NULL;
+    }
+    free(loop->bufs);
+    loop->bufs = NULL;
+    if(loop->sqes != NULL){
+        munmap(loop->sqes, loop->sqes_len);
+        loop->sqes = NULL;
+    }
+    if(loop->ring != NULL){
+        munmap(loop->ring, loop->ring_len);
+        loop->ring = NULL;
+    }
+    if(loop->ring_fd >= 0){
+        close(loop->ring_fd);
+        loop->ring_fd = -1;
+    }
+}
+
+/*
+ * Sets up the ring of @param loop and registers its provided buffers.
+ * @return false, with nothing left set up, if any step fails.
+ */
+static bool ring_init(struct uring_loop *loop)
+{
+    struct io_uring_params p;
+    void *map;
+    char *sq;
+    char *cq;
+
+    memset(&p, 0, sizeof(p));
+    loop->ring_fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if(loop->ring_fd < 0){
+        return false;
+    }
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !ring_probe(loop->ring_fd)){
+        goto fail;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    loop->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    map = mmap(NULL, loop->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               loop->ring_fd, IORING_OFF_SQ_RING);
+    if(map == MAP_FAILED){
+        goto fail;
+    }
+    loop->ring = map;
+    // both rings share one mapping
+    sq = cq = loop->ring;
+    loop->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    map = mmap(NULL, loop->sqes_len, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_SQES);
+    if(map == MAP_FAILED){
+        goto fail;
+    }
+    loop->sqes = map;
+
+    loop->sq_head = (unsigned *) (sq + p.sq_off.head);
+    loop->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    loop->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+    loop->sq_entries = p.sq_entries;
+    unsigned *sq_array = (unsigned *) (sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++){
+        // entries are always submitted in ring order
+        sq_array[i] = i;
+    }
+    loop->cq_head = (unsigned *) (cq + p.cq_off.head);
+    loop->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    loop->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    // register the provided receive buffers
+    map = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(map == MAP_FAILED){
+        goto fail;
+    }
+    loop->br = map;
+    loop->bufs = malloc((size_t) URING_BUF_COUNT * URING_BUF_SIZE);
+    if(loop->bufs == NULL){
+        goto fail;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t) loop->br;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BGID;
+    if(sys_io_uring_register(loop->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+        goto fail;
+    }
+    for (unsigned i = 0; i < URING_BUF_COUNT; i++){
+        buf_recycle(loop, i);
+    }
+
+    loop->tick.tv_sec = 1;
+    TAILQ_INIT(&loop->conns);
+    TAILQ_INIT(&loop->throttled);
+    return true;
+
+    fail:
+        ring_free(loop);
+    return false;
+}
+
+/*
+ * Stops the first @param started loops, which were running, and frees the
+ * rings of the first @param initialized loops along with the connections
+ * accepted meanwhile, so uring_start() fails without leaving anything
+ * behind.
+ */
+static void loops_abort(int started, int initialized)
+{
+    struct uconn *conn;
+
+    __atomic_store_n(&aborting, true, __ATOMIC_RELEASE);
+    eventfd_write(drain_fd, 1);
+    for (int i = 0; i < started; i++){
+        // the kernel cancels what the thread submitted once it exits
+        pthread_join(loops[i].thread, NULL);
+    }
+    for (int i = 0; i < initialized; i++){
+        while ((conn = TAILQ_FIRST(&loops[i].conns)) != NULL){
+            TAILQ_REMOVE(&loops[i].conns, conn, entries);
+            conn->dead = true;
+            conn->inflight = 0;
+            conn_put(conn);
+        }
+        ring_free(&loops[i]);
+    }
+    close(drain_fd);
+    drain_fd = -1;
+    free(loops);
+    loops = NULL;
+    nr_loops = 0;
+}
+
+bool uring_start(int nloops, const int *listen_fds, int nr_listen_fds)
+{
+    if(nloops <= 0){
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nloops = ncpu > 0 ? (int) ncpu : 1;
+    }
+    // every listener needs a loop accepting on it
+    if(nloops < nr_listen_fds){
+        nloops = nr_listen_fds;
+    }
+
+    loops = calloc(nloops, sizeof(*loops));
+    if(loops == NULL){
+        return false;
+    }
+    drain_fd = eventfd(0, EFD_CLOEXEC);
+    if(drain_fd < 0){
+        free(loops);
+        loops = NULL;
+        return false;
+    }
+    // set up every ring before starting anything so failing leaves no threads
+    for (int i = 0; i < nloops; i++){
+        loops[i].listen_fd = listen_fds[i % nr_listen_fds];
+        loops[i].channel = channel_of(loops[i].listen_fd);
+        if(loops[i].channel == NULL && i < nr_listen_fds){
+            fprintf(stderr, "No channel for listener %d, rejecting its connections\n", i);
+        }
+        if(!ring_init(&loops[i])){
+            loops_abort(0, i);
+            return false;
+        }
+    }
+
+    for (int i = 0; i < nloops; i++){
+        if(pthread_create(&loops[i].thread, NULL, uring_loop_run, &loops[i]) != 0){
+            perror("pthread_create");
+            // the loops started may have accepted already, stop them so
+            // the fallback backend is alone on the listeners
+            loops_abort(i, nloops);
+            return false;
+        }
+        nr_loops++;
+    }
+    printf("Started %d io_uring loops\n", nr_loops);
+    return true;
+}
+
+void uring_drain(void)
+{
+    eventfd_write(drain_fd, 1);
+}
+
+#else /* !URING_SUPPORTED */
+
+bool uring_start(int nloops __attribute__((unused)), const int *listen_fds __attribute__((unused)),
+                 int nr_listen_fds __attribute__((unused)))
+{
+    return false;
+}
+
+void uring_drain(void)
+{
+}
+
+#endif /* URING_SUPPORTED */
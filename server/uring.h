@@ -0,0 +1,31 @@
+/*
+ * uring.h
+ *
+ *  @brief io_uring backend for aesdsocket.  Each event loop thread owns a
+ *  submission ring and serves the listeners itself: connections are taken
+ *  with multishot accept, read with multishot recv into a registered ring
+ *  of provided buffers and answered with sendmsg through the same ring.
+ */
+
+#ifndef AESDSOCKET_URING_H
+#define AESDSOCKET_URING_H
+
+#include <stdbool.h>
+
+/**
+ * Starts @param nloops io_uring event loops (0 for one per online cpu), but
+ * at least one per listener, loop i serving the listening socket
+ * @param listen_fds[i % nr_listen_fds].
+ * @return false, without leaving anything started, if the kernel lacks the
+ * io_uring features the backend needs or the loops couldn't be started.
+ */
+bool uring_start(int nloops, const int *listen_fds, int nr_listen_fds);
+
+/**
+ * Tells the event loops to stop accepting and to close their sessions once
+ * their queued responses are sent.  Single packet connections are left to
+ * finish.
+ */
+void uring_drain(void);
+
+#endif /* AESDSOCKET_URING_H */
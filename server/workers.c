@@ -0,0 +1,327 @@
+/**
+ * @file workers.c
+ * @brief Worker threads with work stealing connection deques
+ *
+ * Every queued connection posts the pool's semaphore once, so a worker
+ * returning from sem_wait() is guaranteed a connection in some deque.  It
+ * looks at its own deque first and then at the others in turn.  The deques
+ * are fed by the accept threads rather than their owners, so each one is
+ * a small mutex protected ring rather than a lock free owner/thief deque.
+ *
+ * New connections also take a slot of the room semaphore, given back when
+ * a worker takes them off a deque, so the accept threads wait rather than
+ * queue without bound behind busy workers.  Parked connections are watched
+ * by one thread through a oneshot epoll registration each, and queued
+ * again without waiting for room once ready: they were admitted already,
+ * and only as many of them can come back as there are open connections.
+ * Parked connections with a deadline are kept on a list ordered by it, so
+ * expiring them, or queueing the ones that only waited for the time to
+ * pass, only looks at its head.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "metrics.h"
+#include "workers.h"
+
+#define WORKERS_DEQUE_INITIAL_SIZE 16
+#define WORKERS_PARK_EVENTS 64
+
+struct task {
+    struct worker_conn *conn;
+    // took a slot of the room semaphore, given back once dequeued
+    bool counted;
+};
+
+struct worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    // ring of cap tasks, count of them queued starting at head
+    struct task *tasks;
+    size_t cap;
+    size_t head;
+    size_t count;
+};
+
+static struct worker *workers;
+static int nr_workers;
+static unsigned int next_worker;
+static sem_t pending;
+static sem_t room;
+static worker_handler_t handle_connection;
+static worker_handler_t expire_connection;
+
+// parked connections, and the ones with a deadline in deadline order
+static int park_epfd = -1;
+static int park_wake_fd = -1;
+static pthread_t park_thread;
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+TAILQ_HEAD(worker_conn_list, worker_conn);
+static struct worker_conn_list parked = TAILQ_HEAD_INITIALIZER(parked);
+
+static bool deque_push_back(struct worker *worker, const struct task *task)
+{
+    bool queued = true;
+
+    pthread_mutex_lock(&worker->lock);
+    if(worker->count == worker->cap){
+        size_t cap = worker->cap ? worker->cap * 2 : WORKERS_DEQUE_INITIAL_SIZE;
+        struct task *tasks = malloc(cap * sizeof(*tasks));
+        if(tasks == NULL){
+            queued = false;
+            goto out;
+        }
+        // unwrap the ring into the new storage
+        for (size_t i = 0; i < worker->count; i++){
+            tasks[i] = worker->tasks[(worker->head + i) % worker->cap];
+        }
+        free(worker->tasks);
+        worker->tasks = tasks;
+        worker->cap = cap;
+        worker->head = 0;
+    }
+    worker->tasks[(worker->head + worker->count) % worker->cap] = *task;
+    worker->count++;
+
+    out:
+        pthread_mutex_unlock(&worker->lock);
+    return queued;
+}
+
+/*
+ * Takes the oldest task, as the owner does, or the newest one when
+ * @param steal is set so thieves stay out of the owner's way.
+ */
+static bool deque_pop(struct worker *worker, struct task *task, bool steal)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&worker->lock);
+    if(worker->count > 0){
+        if(steal){
+            *task = worker->tasks[(worker->head + worker->count - 1) % worker->cap];
+        }
+        else{
+            *task = worker->tasks[worker->head];
+            worker->head = (worker->head + 1) % worker->cap;
+        }
+        worker->count--;
+        found = true;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return found;
+}
+
+static void *worker_run(void *arg)
+{
+    struct worker *self = arg;
+    int id = self - workers;
+    struct task task;
+
+    while (1){
+        if(sem_wait(&pending) < 0){
+            continue;
+        }
+        // the semaphore promises a task, keep looking until it turns up
+        bool found = deque_pop(self, &task, false);
+        for (int i = 1; !found; i++){
+            found = deque_pop(&workers[(id + i) % nr_workers], &task, true);
+        }
+        if(task.counted){
+            sem_post(&room);
+        }
+        handle_connection(task.conn);
+    }
+    return NULL;
+}
+
+/*
+ * Queues @param conn on the next worker's deque round robin.
+ */
+static bool queue_task(struct worker_conn *conn, bool counted)
+{
+    struct task task = { .conn = conn, .counted = counted };
+    struct worker *worker = &workers[__atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED) % nr_workers];
+
+    if(!deque_push_back(worker, &task)){
+        return false;
+    }
+    sem_post(&pending);
+    return true;
+}
+
+/*
+ * Stops watching @param conn.  Must be called with park_lock held.
+ */
+static void unpark(struct worker_conn *conn)
+{
+    if(conn->deadline != 0){
+        TAILQ_REMOVE(&parked, conn, parked);
+    }
+    if(conn->events != 0){
+        epoll_ctl(park_epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    }
+}
+
+static void *park_run(void *arg __attribute__((unused)))
+{
+    struct epoll_event events[WORKERS_PARK_EVENTS];
+    struct worker_conn_list expired;
+    struct worker_conn *conn;
+    uint64_t now;
+    int timeout;
+    int n;
+
+    while (1){
+        pthread_mutex_lock(&park_lock);
+        conn = TAILQ_FIRST(&parked);
+        now = metrics_now();
+        // wake up for the earliest deadline, rounded up to a millisecond
+        timeout = conn == NULL ? -1 :
+                  conn->deadline <= now ? 0 : (int) ((conn->deadline - now + 999999) / 1000000);
+        pthread_mutex_unlock(&park_lock);
+
+        n = epoll_wait(park_epfd, events, WORKERS_PARK_EVENTS, timeout);
+        if(n < 0 && errno != EINTR){
+            perror("epoll_wait");
+            continue;
+        }
+        for (int i = 0; i < n; i++){
+            if(events[i].data.ptr == NULL){
+                eventfd_t value;
+                eventfd_read(park_wake_fd, &value);
+                continue;
+            }
+            conn = events[i].data.ptr;
+            pthread_mutex_lock(&park_lock);
+            unpark(conn);
+            pthread_mutex_unlock(&park_lock);
+            if(!queue_task(conn, false)){
+                expire_connection(conn);
+            }
+        }
+
+        // handlers run without the lock, parking may be called from them
+        TAILQ_INIT(&expired);
+        pthread_mutex_lock(&park_lock);
+        now = metrics_now();
+        while ((conn = TAILQ_FIRST(&parked)) != NULL && conn->deadline <= now){
+            unpark(conn);
+            TAILQ_INSERT_TAIL(&expired, conn, parked);
+        }
+        pthread_mutex_unlock(&park_lock);
+        while ((conn = TAILQ_FIRST(&expired)) != NULL){
+            TAILQ_REMOVE(&expired, conn, parked);
+            // waiting for the time to pass was all it had to do
+            if(conn->events == 0 && queue_task(conn, false)){
+                continue;
+            }
+            expire_connection(conn);
+        }
+    }
+    return NULL;
+}
+
+bool workers_start(int nworkers, worker_handler_t handler, worker_handler_t expire)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+
+    if(nworkers <= 0){
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = ncpu > 0 ? (int) ncpu : 1;
+    }
+
+    workers = calloc(nworkers, sizeof(*workers));
+    if(workers == NULL || sem_init(&pending, 0, 0) < 0 ||
+       sem_init(&room, 0, nworkers * WORKERS_QUEUE_MAX) < 0){
+        return false;
+    }
+    handle_connection = handler;
+    expire_connection = expire;
+    nr_workers = nworkers;
+
+    park_epfd = epoll_create1(EPOLL_CLOEXEC);
+    park_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(park_epfd < 0 || park_wake_fd < 0 ||
+       epoll_ctl(park_epfd, EPOLL_CTL_ADD, park_wake_fd, &ev) < 0){
+        perror("epoll");
+        return false;
+    }
+    if(pthread_create(&park_thread, NULL, park_run, NULL) != 0){
+        perror("pthread_create");
+        return false;
+    }
+
+    for (int i = 0; i < nworkers; i++){
+        pthread_mutex_init(&workers[i].lock, NULL);
+    }
+    for (int i = 0; i < nworkers; i++){
+        if(pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0){
+            perror("pthread_create");
+            return false;
+        }
+    }
+    printf("Started %d workers\n", nr_workers);
+    return true;
+}
+
+bool workers_submit(struct worker_conn *conn)
+{
+    while (sem_wait(&room) < 0){
+        // only interrupted, the slot is still to be taken
+    }
+    if(!queue_task(conn, true)){
+        sem_post(&room);
+        return false;
+    }
+    return true;
+}
+
+bool workers_park(struct worker_conn *conn)
+{
+    struct epoll_event ev = { .events = conn->events | EPOLLONESHOT, .data.ptr = conn };
+    struct worker_conn *prev;
+    bool first = false;
+
+    pthread_mutex_lock(&park_lock);
+    if(conn->deadline != 0){
+        // deadlines mostly come in order, look for the spot from the end
+        prev = TAILQ_LAST(&parked, worker_conn_list);
+        while (prev != NULL && prev->deadline > conn->deadline){
+            prev = TAILQ_PREV(prev, worker_conn_list, parked);
+        }
+        if(prev == NULL){
+            TAILQ_INSERT_HEAD(&parked, conn, parked);
+            first = true;
+        }
+        else{
+            TAILQ_INSERT_AFTER(&parked, prev, conn, parked);
+        }
+    }
+    if(conn->events & EPOLLIN){
+        // a hang up is read as end of file, wake up for it too
+        ev.events |= EPOLLRDHUP;
+    }
+    // registered last, the watching thread may queue it right away
+    if(conn->events != 0 && epoll_ctl(park_epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0){
+        if(conn->deadline != 0){
+            TAILQ_REMOVE(&parked, conn, parked);
+        }
+        pthread_mutex_unlock(&park_lock);
+        return false;
+    }
+    pthread_mutex_unlock(&park_lock);
+
+    // an earlier deadline than the watching thread sleeps for
+    if(first){
+        eventfd_write(park_wake_fd, 1);
+    }
+    return true;
+}
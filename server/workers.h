@@ -0,0 +1,77 @@
+/*
+ * workers.h
+ *
+ *  @brief Fixed pool of worker threads serving connections in thread mode.
+ *  Each worker owns a deque of connections ready to be served.  The accept
+ *  threads spread new connections over the deques, a worker serves its own
+ *  deque oldest first and steals from the other end of a busy worker's
+ *  deque once its own runs dry.  A connection that has to wait, for the
+ *  client to send more, for room to send its echo or for the rate limit, is
+ *  parked instead of holding on to its worker, and queued again once it can
+ *  go on, so slow or idle clients can't starve the others.
+ */
+
+#ifndef AESDSOCKET_WORKERS_H
+#define AESDSOCKET_WORKERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "queue.h"
+
+// new connections queued at most per worker, accepting waits beyond that
+#define WORKERS_QUEUE_MAX 256
+
+/*
+ * A connection served by the pool, embedded at the start of the caller's
+ * connection record
+ */
+struct worker_conn {
+    int fd;
+    /**
+     * Event a parked connection waits for, EPOLLIN or EPOLLOUT, or 0 to
+     * wait for its deadline alone
+     */
+    uint32_t events;
+    /**
+     * metrics_now() time after which a parked connection expires, or is
+     * queued again when it waits for no event.  0 for never
+     */
+    uint64_t deadline;
+    TAILQ_ENTRY(worker_conn) parked;
+};
+
+/**
+ * Called on a worker thread to serve @param conn until it is done or
+ * parked with workers_park(), or on the parking thread once @param conn
+ * expired while parked.
+ */
+typedef void (*worker_handler_t)(struct worker_conn *conn);
+
+/**
+ * Starts @param nworkers worker threads running @param handler, and the
+ * thread watching parked connections running @param expire.  Pass 0 to
+ * use one worker per online cpu.
+ * @return true if all threads were started.
+ */
+bool workers_start(int nworkers, worker_handler_t handler, worker_handler_t expire);
+
+/**
+ * Queues the accepted connection @param conn for a worker, which owns it
+ * on success.  Waits while WORKERS_QUEUE_MAX connections per worker are
+ * already queued, the backlog then holds further clients.
+ * @return true if the connection was queued.
+ */
+bool workers_submit(struct worker_conn *conn);
+
+/**
+ * Called by the handler to stop serving @param conn until its socket is
+ * ready for its events, or until its deadline when it then expires.  One
+ * waiting for no event needs a deadline, and is queued again once it
+ * passed.  The handler must
+ * not touch @param conn afterwards on success, it may already be served by
+ * another worker.
+ * @return true if the connection was parked.
+ */
+bool workers_park(struct worker_conn *conn);
+
+#endif /* AESDSOCKET_WORKERS_H */
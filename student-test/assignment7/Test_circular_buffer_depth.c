@@ -0,0 +1,152 @@
+#include "unity.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+static const char *depth_writes[] = {
+    "a\n", "bb\n", "ccc\n", "dddd\n", "eeeee\n", "ffffff\n", "ggggggg\n", "hhhhhhhh\n",
+};
+
+/**
+ * Adds depth_writes[@param i] to @param buffer
+ * @return the buffptr of the entry it evicted
+ */
+static const char *add_depth_write(struct aesd_circular_buffer *buffer, int i)
+{
+    struct aesd_buffer_entry entry;
+    entry.buffptr = depth_writes[i];
+    entry.size = strlen(depth_writes[i]);
+    return aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+/**
+ * Verifies @param buffer holds exactly depth_writes[@param first] to depth_writes[@param last],
+ * looking each one up by its first and last byte
+ */
+static void verify_holds(struct aesd_circular_buffer *buffer, int first, int last)
+{
+    struct aesd_buffer_entry *entry;
+    size_t offset_rtn;
+    size_t start = 0;
+    int i;
+
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(last - first + 1, aesd_circular_buffer_count(buffer),
+            "Wrong number of entries held");
+    for (i = first; i <= last; i++){
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, start, &offset_rtn);
+        TEST_ASSERT_NOT_NULL(entry);
+        TEST_ASSERT_EQUAL_PTR(depth_writes[i], entry->buffptr);
+        TEST_ASSERT_EQUAL_INT(0, offset_rtn);
+        start += strlen(depth_writes[i]);
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, start - 1, &offset_rtn);
+        TEST_ASSERT_NOT_NULL(entry);
+        TEST_ASSERT_EQUAL_PTR(depth_writes[i], entry->buffptr);
+        TEST_ASSERT_EQUAL_INT(strlen(depth_writes[i]) - 1, offset_rtn);
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(start, buffer->total_size, "Wrong total_size");
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(buffer, start, &offset_rtn));
+}
+
+/**
+ * Resizes @param buffer to @param depth entries the way the driver does, freeing the old slots
+ */
+static void resize_depth(struct aesd_circular_buffer *buffer, uint32_t depth)
+{
+    struct aesd_circular_buffer resized;
+    struct aesd_buffer_slots *slots = aesd_circular_buffer_alloc_slots(depth);
+
+    TEST_ASSERT_NOT_NULL(slots);
+    aesd_circular_buffer_resize(buffer, slots, depth, &resized);
+    aesd_circular_buffer_free(buffer);
+    *buffer = resized;
+}
+
+void test_circular_buffer_init_depth()
+{
+    struct aesd_circular_buffer buffer;
+
+    TEST_ASSERT_EQUAL_INT(-EINVAL, aesd_circular_buffer_init_depth(&buffer, 0));
+    TEST_ASSERT_NULL(buffer.slots);
+    TEST_ASSERT_EQUAL_INT(-EINVAL, aesd_circular_buffer_init_depth(&buffer, AESDCHAR_MAX_DEPTH + 1));
+    TEST_ASSERT_NULL(buffer.slots);
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_depth(&buffer, AESDCHAR_MAX_DEPTH));
+    TEST_ASSERT_EQUAL_UINT32(AESDCHAR_MAX_DEPTH - 1, buffer.slots->mask);
+    aesd_circular_buffer_free(&buffer);
+
+    // a depth below a power of two fills up and wraps at that depth
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_depth(&buffer, 3));
+    TEST_ASSERT_EQUAL_UINT32(3, buffer.slots->mask);
+    TEST_ASSERT_NULL(add_depth_write(&buffer, 0));
+    TEST_ASSERT_NULL(add_depth_write(&buffer, 1));
+    TEST_ASSERT_NULL(add_depth_write(&buffer, 2));
+    TEST_ASSERT_TRUE(buffer.full);
+    TEST_ASSERT_EQUAL_PTR(depth_writes[0], add_depth_write(&buffer, 3));
+    TEST_ASSERT_EQUAL_PTR(depth_writes[1], add_depth_write(&buffer, 4));
+    verify_holds(&buffer, 2, 4);
+    aesd_circular_buffer_free(&buffer);
+}
+
+void test_circular_buffer_resize_shrink_wrapped()
+{
+    struct aesd_circular_buffer buffer;
+    int i;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_depth(&buffer, 4));
+    for (i = 0; i < 6; i++){
+        add_depth_write(&buffer, i);
+    }
+    // in_offs wrapped past the end of the slots, out_offs followed it
+    TEST_ASSERT_EQUAL_UINT32(2, buffer.in_offs);
+    TEST_ASSERT_EQUAL_UINT32(2, buffer.out_offs);
+    verify_holds(&buffer, 2, 5);
+
+    // shrinking keeps the most recent entries, the caller frees depth_writes[2]
+    resize_depth(&buffer, 3);
+    TEST_ASSERT_TRUE(buffer.full);
+    verify_holds(&buffer, 3, 5);
+    TEST_ASSERT_EQUAL_PTR(depth_writes[3], add_depth_write(&buffer, 6));
+    TEST_ASSERT_EQUAL_PTR(depth_writes[4], add_depth_write(&buffer, 7));
+    verify_holds(&buffer, 5, 7);
+
+    resize_depth(&buffer, 1);
+    verify_holds(&buffer, 7, 7);
+    TEST_ASSERT_EQUAL_PTR(depth_writes[7], add_depth_write(&buffer, 0));
+    verify_holds(&buffer, 0, 0);
+    aesd_circular_buffer_free(&buffer);
+}
+
+void test_circular_buffer_resize_grow()
+{
+    struct aesd_circular_buffer buffer;
+    int i;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_depth(&buffer, 2));
+    for (i = 0; i < 3; i++){
+        add_depth_write(&buffer, i);
+    }
+    verify_holds(&buffer, 1, 2);
+
+    // growing keeps every entry and makes room for more before evicting again
+    resize_depth(&buffer, 5);
+    TEST_ASSERT_FALSE(buffer.full);
+    verify_holds(&buffer, 1, 2);
+    for (i = 3; i < 6; i++){
+        TEST_ASSERT_NULL(add_depth_write(&buffer, i));
+    }
+    TEST_ASSERT_TRUE(buffer.full);
+    verify_holds(&buffer, 1, 5);
+    TEST_ASSERT_EQUAL_PTR(depth_writes[1], add_depth_write(&buffer, 6));
+    verify_holds(&buffer, 2, 6);
+
+    // an empty buffer resizes to an empty one
+    aesd_circular_buffer_free(&buffer);
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_depth(&buffer, 4));
+    resize_depth(&buffer, 8);
+    TEST_ASSERT_EQUAL_UINT32(0, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_NULL(add_depth_write(&buffer, 0));
+    verify_holds(&buffer, 0, 0);
+    aesd_circular_buffer_free(&buffer);
+}
@@ -0,0 +1,132 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+static const char find_bytes[] = "0123456789abcdef";
+
+/**
+ * Adds @param count entries of 1 to 16 bytes to @param buffer, evicting the oldest ones once full
+ */
+static void add_find_entries(struct aesd_circular_buffer *buffer, uint32_t count)
+{
+    struct aesd_buffer_entry entry;
+    uint32_t i;
+
+    for (i = 0; i < count; i++){
+        entry.buffptr = find_bytes;
+        entry.size = 1 + (i * 7) % 16;
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+/**
+ * Looks @param char_offset up in @param buffer the way find_entry did before it searched,
+ * walking the entries from the oldest one
+ */
+static struct aesd_buffer_entry *linear_find(struct aesd_circular_buffer *buffer, size_t char_offset,
+            size_t *entry_offset_byte_rtn)
+{
+    struct aesd_buffer_entry *entry;
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    uint32_t i;
+
+    for (i = 0; i < count; i++){
+        entry = &buffer->slots->entry[(buffer->out_offs + i) & buffer->slots->mask];
+        if(char_offset < entry->size){
+            *entry_offset_byte_rtn = char_offset;
+            return entry;
+        }
+        char_offset -= entry->size;
+    }
+    return NULL;
+}
+
+static void verify_find_matches_linear(struct aesd_circular_buffer *buffer, size_t char_offset)
+{
+    struct aesd_buffer_entry *expect;
+    struct aesd_buffer_entry *found;
+    size_t expect_offset = 0;
+    size_t found_offset = 0;
+
+    expect = linear_find(buffer, char_offset, &expect_offset);
+    found = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset, &found_offset);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(expect, found, "find_entry and a linear scan disagree on the entry");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(expect_offset, found_offset, "find_entry and a linear scan disagree on the offset");
+}
+
+/**
+ * Verifies every entry of @param buffer is found by its first and last byte, as a linear scan
+ * finds it, and that a handful of offsets around the end agree with one as well
+ */
+static void verify_find_all(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *entry;
+    struct aesd_buffer_entry *found;
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    size_t start = 0;
+    size_t offset_rtn;
+    size_t tail;
+    uint32_t i;
+
+    for (i = 0; i < count; i++){
+        entry = &buffer->slots->entry[(buffer->out_offs + i) & buffer->slots->mask];
+        found = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, start, &offset_rtn);
+        TEST_ASSERT_EQUAL_PTR(entry, found);
+        TEST_ASSERT_EQUAL_INT(0, offset_rtn);
+        start += entry->size;
+        found = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, start - 1, &offset_rtn);
+        TEST_ASSERT_EQUAL_PTR(entry, found);
+        TEST_ASSERT_EQUAL_INT(entry->size - 1, offset_rtn);
+    }
+    TEST_ASSERT_EQUAL_INT(start, buffer->total_size);
+    tail = start < 8 ? 0 : start - 8;
+    for (i = 0; i < 16; i++){
+        verify_find_matches_linear(buffer, (size_t)i * 7919);
+        verify_find_matches_linear(buffer, start / 2 + i);
+        verify_find_matches_linear(buffer, tail + i);
+    }
+}
+
+void test_circular_buffer_find_max_depth_wrapped()
+{
+    struct aesd_circular_buffer buffer;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_depth(&buffer, AESDCHAR_MAX_DEPTH));
+    add_find_entries(&buffer, AESDCHAR_MAX_DEPTH / 2);
+    verify_find_all(&buffer);
+
+    // past the depth out_offs follows in_offs around the slots
+    add_find_entries(&buffer, AESDCHAR_MAX_DEPTH / 2 + AESDCHAR_MAX_DEPTH / 3);
+    TEST_ASSERT_TRUE(buffer.full);
+    TEST_ASSERT_EQUAL_UINT32(AESDCHAR_MAX_DEPTH / 3, buffer.out_offs);
+    verify_find_all(&buffer);
+    aesd_circular_buffer_free(&buffer);
+}
+
+void test_circular_buffer_find_partial_depth_wrapped()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer resized;
+    struct aesd_buffer_slots *slots;
+    uint32_t depth = AESDCHAR_MAX_DEPTH / 2 + 3;
+
+    // a depth above a power of two leaves slots unused, the entries held wrap around them
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_depth(&buffer, depth));
+    add_find_entries(&buffer, 2 * depth + depth / 4);
+    TEST_ASSERT_TRUE(buffer.full);
+    TEST_ASSERT_TRUE(buffer.in_offs < buffer.out_offs);
+    verify_find_all(&buffer);
+
+    // resizing keeps the starts of the entries it copies, relative offsets still hold
+    slots = aesd_circular_buffer_alloc_slots(depth - 5);
+    TEST_ASSERT_NOT_NULL(slots);
+    aesd_circular_buffer_resize(&buffer, slots, depth - 5, &resized);
+    aesd_circular_buffer_free(&buffer);
+    buffer = resized;
+    verify_find_all(&buffer);
+    add_find_entries(&buffer, depth / 3);
+    verify_find_all(&buffer);
+    aesd_circular_buffer_free(&buffer);
+}